@@ -1,51 +1,406 @@
+#include <cerrno>
 #include <cstring>
 #include <cmath>
+#include <cstdlib>
 #include <stdint.h>
 #include <iostream>
 #include <iomanip>
-#ifdef HAVE_GETTIMEOFDAY
+#include <new>
+#if defined(HAVE_CLOCK_GETTIME)
+#include <time.h>
+#elif defined(HAVE_GETTIMEOFDAY)
 #include <sys/time.h>
 #else
 #include <windows.h>
 #endif
+#ifdef HAVE_PERF_EVENTS
+#include <linux/perf_event.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#ifdef HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#include <unistd.h>
+#include <vector>
+#endif
 #include "tables.h"
 
 using namespace std;
 
+// === Counting allocations
+//
+// Every allocation in the program, whichever allocator policy a table uses,
+// ends up in this operator new. It counts calls and bytes so that the speed
+// tests can report how much each trial allocated.
+
+static uint64_t heap_allocations = 0;
+static uint64_t heap_bytes = 0;
+
+struct AllocCounts {
+    uint64_t allocations;
+    uint64_t bytes;
+};
+
+static AllocCounts current_alloc_counts()
+{
+    AllocCounts c;
+#ifdef HAVE_PTHREADS
+    c.allocations = __atomic_load_n(&heap_allocations, __ATOMIC_RELAXED);
+    c.bytes = __atomic_load_n(&heap_bytes, __ATOMIC_RELAXED);
+#else
+    c.allocations = heap_allocations;
+    c.bytes = heap_bytes;
+#endif
+    return c;
+}
+
+// Kept out of line so that GCC doesn't see free() applied to the result of
+// operator new and warn about it.
+#ifdef __GNUC__
+#define NOINLINE __attribute__((noinline))
+#else
+#define NOINLINE
+#endif
+
+#if __cplusplus >= 201103L
+#define THROWS_BAD_ALLOC
+#define THROWS_NOTHING noexcept
+#else
+#define THROWS_BAD_ALLOC throw (std::bad_alloc)
+#define THROWS_NOTHING throw ()
+#endif
+
+NOINLINE void *operator new(size_t nbytes) THROWS_BAD_ALLOC
+{
+#ifdef HAVE_PTHREADS
+    __atomic_fetch_add(&heap_allocations, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&heap_bytes, nbytes, __ATOMIC_RELAXED);
+#else
+    heap_allocations++;
+    heap_bytes += nbytes;
+#endif
+    void *p = malloc(nbytes ? nbytes : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+NOINLINE void *operator new[](size_t nbytes) THROWS_BAD_ALLOC { return operator new(nbytes); }
+NOINLINE void operator delete(void *p) THROWS_NOTHING { free(p); }
+NOINLINE void operator delete[](void *p) THROWS_NOTHING { operator delete(p); }
+#ifdef __cpp_sized_deallocation
+// C++14 calls these when it knows the size. Replace them too, or -Wextra
+// warns that the sized versions still go to the library's operator delete.
+NOINLINE void operator delete(void *p, size_t) THROWS_NOTHING { free(p); }
+NOINLINE void operator delete[](void *p, size_t) THROWS_NOTHING { operator delete(p); }
+#endif
+
+
 // === Code for measuring speed
 //
 // Instead of producing a single number, we want to produce several data
 // points. Then we'll plot them, and we'll be able to see noise, nonlinearity,
 // and any other nonobvious weirdness.
 
-// Run a Test of size n once. Return the elapsed time in seconds.
+// Measures elapsed wall-clock time. With HAVE_CLOCK_GETTIME this uses
+// CLOCK_MONOTONIC_RAW, which has nanosecond resolution and isn't slewed by
+// NTP; otherwise gettimeofday, or QueryPerformanceCounter on Windows.
+class Stopwatch {
+#if defined(HAVE_CLOCK_GETTIME)
+    struct timespec t0;
+
+    static void now(struct timespec *t) {
+#ifdef CLOCK_MONOTONIC_RAW
+        clock_gettime(CLOCK_MONOTONIC_RAW, t);
+#else
+        clock_gettime(CLOCK_MONOTONIC, t);
+#endif
+    }
+
+public:
+    void start() { now(&t0); }
+    double elapsed() const {
+        struct timespec t1;
+        now(&t1);
+        return t1.tv_sec - t0.tv_sec + 1e-9 * (t1.tv_nsec - t0.tv_nsec);
+    }
+
+    // The clock itself, in nanoseconds from some arbitrary starting point.
+    static uint64_t nanoseconds() {
+        struct timespec t;
+        now(&t);
+        return uint64_t(t.tv_sec) * 1000000000 + uint64_t(t.tv_nsec);
+    }
+#elif defined(HAVE_GETTIMEOFDAY)
+    struct timeval t0;
+
+public:
+    void start() { gettimeofday(&t0, NULL); }
+    double elapsed() const {
+        struct timeval t1;
+        gettimeofday(&t1, NULL);
+        return t1.tv_sec - t0.tv_sec + 1e-6 * (t1.tv_usec - t0.tv_usec);
+    }
+#else
+    LARGE_INTEGER f, t0;
+
+public:
+    void start() {
+        if (!QueryPerformanceFrequency(&f))
+            abort();
+        if (!QueryPerformanceCounter(&t0))
+            abort();
+    }
+    double elapsed() const {
+        LARGE_INTEGER t1;
+        if (!QueryPerformanceCounter(&t1))
+            abort();
+        return double(t1.QuadPart - t0.QuadPart) / double(f.QuadPart);
+    }
+#endif
+};
+
+#ifdef HAVE_PERF_EVENTS
+// === Hardware performance counters
+//
+// With -c, each timed run also counts these events using perf_event_open(2),
+// in user mode only, and run_time_trials reports them per operation. A
+// counter the kernel won't give us (no PMU, as in many VMs, or
+// perf_event_paranoid too high) is reported as null.
+
+struct PerfEventSpec {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+};
+
+#define HW_CACHE_MISS(cache) \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const PerfEventSpec perf_events[] = {
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "L1d_misses", PERF_TYPE_HW_CACHE, HW_CACHE_MISS(PERF_COUNT_HW_CACHE_L1D) },
+    { "LLC_misses", PERF_TYPE_HW_CACHE, HW_CACHE_MISS(PERF_COUNT_HW_CACHE_LL) },
+    { "dTLB_misses", PERF_TYPE_HW_CACHE, HW_CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB) },
+    { "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+enum { NumPerfEvents = sizeof(perf_events) / sizeof(perf_events[0]) };
+
+static bool count_events = false;
+
+// One counter per event, for the calling thread. Each counter is opened
+// separately rather than as a group, so that if the PMU can't schedule them
+// all at once the kernel multiplexes them and we scale the counts up.
+class PerfCounters {
+    int fds[NumPerfEvents];
+
+    PerfCounters(const PerfCounters &);
+    PerfCounters &operator=(const PerfCounters &);
+
+public:
+    PerfCounters() {
+        static bool warned = false;
+        for (int i = 0; i < NumPerfEvents; i++) {
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = perf_events[i].type;
+            attr.config = perf_events[i].config;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            fds[i] = int(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+            if (fds[i] < 0 && !warned) {
+                cerr << "hashbench: can't count " << perf_events[i].name << ": "
+                     << strerror(errno) << endl;
+            }
+        }
+        warned = true;
+    }
+
+    ~PerfCounters() {
+        for (int i = 0; i < NumPerfEvents; i++) {
+            if (fds[i] >= 0)
+                close(fds[i]);
+        }
+    }
+
+    void start() {
+        for (int i = 0; i < NumPerfEvents; i++) {
+            if (fds[i] >= 0) {
+                ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+                ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+    }
+
+    void stop() {
+        for (int i = 0; i < NumPerfEvents; i++) {
+            if (fds[i] >= 0)
+                ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+
+    // Store the count for event i in *count, scaled up if the counter was
+    // only running part of the time. Return false if there is no count.
+    bool read_count(int i, double *count) const {
+        uint64_t buf[3];  // value, time enabled, time running
+        if (fds[i] < 0 || read(fds[i], buf, sizeof(buf)) != ssize_t(sizeof(buf)) || buf[2] == 0)
+            return false;
+        *count = double(buf[0]) * (double(buf[1]) / double(buf[2]));
+        return true;
+    }
+};
+
+// Keep this thread on the CPU it's on now, so that counts aren't split
+// across CPUs and caches don't go cold from migration.
+static void pin_to_current_cpu()
+{
+    int cpu = sched_getcpu();
+    if (cpu < 0)
+        return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+}
+#endif  // HAVE_PERF_EVENTS
+
+#ifdef TABLE_STATS
+// === Table statistics
+//
+// With -s, after each timed run of a test that has an OpenTable or a
+// CloseTable member named table, run_time_trials also prints what
+// table.stats() says (see "Table statistics" in tables.h).
+
+static bool dump_stats = false;
+
+// HasTable<Test>::value is true if Test has a member named table.
+template <class Test>
+class HasTable {
+    template <size_t> struct Probe {};
+    template <class U> static char check(Probe<sizeof(&U::table)> *);
+    template <class U> static long check(...);
+
+public:
+    enum { value = sizeof(check<Test>(0)) == 1 };
+};
+
+template <bool> struct BoolType {};
+
+// Only OpenTable and CloseTable keep statistics. (A class derived from one,
+// like Unbatched<OpenTable>, gets the first overload.)
+template <class Table>
+bool get_table_stats(const Table &, TableStats *) { return false; }
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+bool get_table_stats(const BasicOpenTable<K, V, HashPolicy, Traits, Alloc> &table, TableStats *out)
+{
+    *out = table.stats();
+    return true;
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+bool get_table_stats(const BasicCloseTable<K, V, HashPolicy, Traits, Alloc> &table, TableStats *out)
+{
+    *out = table.stats();
+    return true;
+}
+
+template <class Test>
+bool get_test_stats(const Test &test, TableStats *out, BoolType<true>)
+{
+    return get_table_stats(test.table, out);
+}
+
+template <class Test>
+bool get_test_stats(const Test &, TableStats *, BoolType<false>) { return false; }
+
+static void write_table_stats(const TableStats &s)
+{
+    cout << "{\"live\": " << s.live
+         << ", \"buckets\": " << s.buckets
+         << ", \"dead\": " << s.dead_fraction
+         << ", \"histogram\": [";
+    for (int i = 0; i < TableStats::HistogramSize; i++)
+        cout << (i ? ", " : "") << s.histogram[i];
+    cout << "], \"hits\": " << s.hits
+         << ", \"probes_per_hit\": " << s.probes_per_hit()
+         << ", \"misses\": " << s.misses
+         << ", \"probes_per_miss\": " << s.probes_per_miss()
+         << ", \"grows\": " << s.grows
+         << ", \"shrinks\": " << s.shrinks
+         << ", \"purges\": " << s.purges
+         << ", \"rehash_seconds\": " << s.rehash_seconds << '}';
+}
+#endif  // TABLE_STATS
+
+// What a timed run did, besides take time.
+struct RunStats {
+    AllocCounts allocs;
+#ifdef HAVE_PERF_EVENTS
+    bool have_event[NumPerfEvents];
+    double events[NumPerfEvents];
+#endif
+#ifdef TABLE_STATS
+    bool have_table_stats;
+    TableStats table_stats;
+#endif
+};
+
+// Run a Test of size n once. Return the elapsed time in seconds. If stats is
+// non-null, also fill it in.
 template <class Test>
-double measure_single_run(size_t n)
+double measure_single_run(size_t n, RunStats *stats = NULL)
 {
     Test test;
     test.setup(n);
 
-#ifdef HAVE_GETTIMEOFDAY
-    struct timeval t0, t1;
-    gettimeofday(&t0, NULL);
-#else
-    LARGE_INTEGER f, t0, t1;
-    if (!QueryPerformanceFrequency(&f))
-        abort();
-    if (!QueryPerformanceCounter(&t0))
-        abort();
+#ifdef HAVE_PERF_EVENTS
+    PerfCounters *counters = stats && count_events ? new PerfCounters : NULL;
+    if (counters)
+        counters->start();
 #endif
+    AllocCounts before = current_alloc_counts();
+    Stopwatch watch;
+    watch.start();
 
     test.run(n);
 
-#ifdef HAVE_GETTIMEOFDAY
-    gettimeofday(&t1, NULL);
-    return t1.tv_sec - t0.tv_sec + 1e-6 * (t1.tv_usec - t0.tv_usec);
-#else
-    if (!QueryPerformanceCounter(&t1))
-        abort();
-    return double(t1.QuadPart - t0.QuadPart) / double(f.QuadPart);
+    double dt = watch.elapsed();
+    AllocCounts after = current_alloc_counts();
+#ifdef HAVE_PERF_EVENTS
+    if (counters) {
+        counters->stop();
+        for (int i = 0; i < NumPerfEvents; i++)
+            stats->have_event[i] = counters->read_count(i, &stats->events[i]);
+        delete counters;
+    } else if (stats) {
+        for (int i = 0; i < NumPerfEvents; i++)
+            stats->have_event[i] = false;
+    }
+#endif
+
+    if (stats) {
+        stats->allocs.allocations = after.allocations - before.allocations;
+        stats->allocs.bytes = after.bytes - before.bytes;
+#ifdef TABLE_STATS
+        stats->have_table_stats = dump_stats
+            && get_test_stats(test, &stats->table_stats, BoolType<HasTable<Test>::value>());
 #endif
+    }
+    return dt;
 }
 
 const double min_run_seconds = 0.1;
@@ -58,6 +413,12 @@ const double max_run_seconds = 1.0;
 // resizes) that occur at exponentially spaced intervals. We want to make sure
 // we don't miss those.
 //
+// Each trial is printed as [n, seconds, allocations, bytes allocated], the
+// last two counting only what happened during the timed part. With -c, a
+// fifth element is an object giving each hardware event count per operation.
+// With -s, the last element is the table's statistics at the end of the run,
+// or null if it keeps none.
+//
 template <class Test>
 void run_time_trials()
 {
@@ -79,8 +440,32 @@ void run_time_trials()
     for (int i = 0; i < trials; i++) {
         double target_dt = min_run_seconds + double(i) / (trials - 1) * (max_run_seconds - min_run_seconds);
         size_t n = size_t(ceil(estimated_speed * target_dt));
-        double dt = measure_single_run<Test>(n);
-        cout << "\t\t[" << n << ", " << dt << (i < trials - 1 ? "]," : "]") << endl;
+        RunStats stats;
+        double dt = measure_single_run<Test>(n, &stats);
+        cout << "\t\t[" << n << ", " << dt << ", " << stats.allocs.allocations << ", " << stats.allocs.bytes;
+#ifdef HAVE_PERF_EVENTS
+        if (count_events) {
+            cout << ", {";
+            for (int e = 0; e < NumPerfEvents; e++) {
+                cout << (e ? ", \"" : "\"") << perf_events[e].name << "\": ";
+                if (stats.have_event[e])
+                    cout << stats.events[e] / n;
+                else
+                    cout << "null";
+            }
+            cout << '}';
+        }
+#endif
+#ifdef TABLE_STATS
+        if (dump_stats) {
+            cout << ", ";
+            if (stats.have_table_stats)
+                write_table_stats(stats.table_stats);
+            else
+                cout << "null";
+        }
+#endif
+        cout << (i < trials - 1 ? "]," : "]") << endl;
     }
 
     cout << "\t]";
@@ -138,6 +523,31 @@ struct InsertSmallTest : GoodTest {
     }
 };
 
+// InsertSmallTest for tables that allocate from an Arena: the arena is
+// released after every batch of ArenaBatch tables.
+template <class Table>
+struct InsertSmallArenaTest : GoodTest {
+    enum { ArenaBatch = 8 };
+    Arena arena;
+
+    void setup(size_t) {}
+    void run(size_t n) {
+        Arena::Scope scope(arena);
+        Key k = 1;
+        for (size_t t = 1; n; t++) {
+            {
+                Table table;
+                do {
+                    table.set(k, k);
+                    k = k * 1103515245 + 12345;
+                } while (--n && k % 145 != 0);
+            }
+            if (t % ArenaBatch == 0)
+                arena.release();
+        }
+    }
+};
+
 template <class Table>
 struct LookupHitTest : GoodTest {
     enum { M = 8675309 + 1 }; // jenny's number, a prime, plus 1
@@ -192,6 +602,92 @@ struct LookupMissTest : GoodTest {
     }
 };
 
+// LookupHitTest and LookupMissTest use a table that stays in cache. These two
+// tests instead look keys up in a table of Size entries, much bigger than the
+// last-level cache, in a random order, BatchSize at a time, using get_many.
+// run_batch_speed_test runs them against get_many and against Unbatched,
+// which calls get in a loop.
+template <class Table>
+struct BigTableTest : GoodTest {
+    enum { Size = 1 << 22, BatchSize = 256 };
+    Table table;
+
+    static Key key(size_t j) { return Key(j + 1) * 0x9E3779B97F4A7C15ULL; }
+
+    // Step through 0..Size-1 in a scrambled order. (This LCG has full
+    // period because Size is a power of two.)
+    static size_t next(size_t j) { return (j * 5 + 1) & (Size - 1); }
+
+    void setup(size_t) {
+        for (size_t j = 0; j < Size; j++)
+            table.set(key(j), key(j));
+    }
+};
+
+template <class Table>
+struct LookupHitBatchTest : BigTableTest<Table> {
+    typedef BigTableTest<Table> Base;
+
+    void run(size_t n) {
+        Key keys[Base::BatchSize];
+        Value values[Base::BatchSize];
+        size_t j = 0;
+        for (size_t i = 0; i < n; i += Base::BatchSize) {
+            size_t m = n - i < size_t(Base::BatchSize) ? n - i : size_t(Base::BatchSize);
+            for (size_t b = 0; b < m; b++) {
+                keys[b] = Base::key(j);
+                j = Base::next(j);
+            }
+            this->table.get_many(keys, values, m);
+            for (size_t b = 0; b < m; b++) {
+                if (values[b] != keys[b])
+                    abort();
+            }
+        }
+    }
+};
+
+template <class Table>
+struct LookupMissBatchTest : BigTableTest<Table> {
+    typedef BigTableTest<Table> Base;
+
+    void run(size_t n) {
+        Key keys[Base::BatchSize];
+        Value values[Base::BatchSize];
+        size_t j = 0;
+        for (size_t i = 0; i < n; i += Base::BatchSize) {
+            size_t m = n - i < size_t(Base::BatchSize) ? n - i : size_t(Base::BatchSize);
+            for (size_t b = 0; b < m; b++) {
+                keys[b] = Base::key(j + Base::Size);
+                j = Base::next(j);
+            }
+            this->table.get_many(keys, values, m);
+            for (size_t b = 0; b < m; b++) {
+                if (values[b] != 0)
+                    abort();
+            }
+        }
+    }
+};
+
+// A Table whose get_many just calls get once per key, for comparison.
+template <class Table>
+struct Unbatched : Table {
+    void get_many(const Key *keys, Value *values, size_t n) const {
+        for (size_t i = 0; i < n; i++)
+            values[i] = this->get(keys[i]);
+    }
+};
+
+// A set dressed up as a map, so that the speed tests can run against OpenSet
+// and CloseSet. set adds the key, whatever the value; get(k) returns k if k is
+// present, which is all the tests that check values look for.
+template <class Set>
+struct SetAsMap : Set {
+    void set(Key k, Value) { Set::set(k, true); }
+    Value get(Key k) const { return this->has(k) ? k : Value(); }
+};
+
 // This test adds and removes entries from a table in FIFO order.
 template <class Table>
 struct WorklistTest : GoodTest {
@@ -271,92 +767,1485 @@ struct LookupAfterDeleteTest : GoodTest {
     }
 };
 
-template <template <class> class Test>
-void run_speed_test()
-{
-    cout << '{' << endl;
-
-#ifdef HAVE_SPARSEHASH
-    cout << "\t\"DenseTable\": ";
-    run_time_trials<Test<DenseTable> >();
-    cout << ',' << endl;
-#endif
-
-    cout << "\t\"OpenTable\": ";
-    run_time_trials<Test<OpenTable> >();
-    cout << ',' << endl;
+// IterateAfterDeleteTest walks a table from which 3 of every 4 keys have
+// been removed: of each 256 keys set, in order, the first 64 stay and the
+// other 192 are removed. In a CloseTable that leaves a live 64-entry word of
+// live_bits followed by three empty ones, all the way along the entries
+// vector. That is as many holes as a CloseTable keeps: remove() compacts the
+// vector once fewer than 1/4 of its entries are live. Walking the entries one
+// by one pays for every hole; for_each and the Iterator skip each empty word
+// at once. An OpenTable given the same removes shrinks to fit as it goes, so
+// it walks a table of its usual density.
 
-    cout << "\t\"CloseTable\": ";
-    run_time_trials<Test<CloseTable> >();
-    cout << endl;
+struct SumEntries {
+    Value sum;
+    size_t count;
+    SumEntries() : sum(0), count(0) {}
+    void operator()(const Key &, const Value &v) { sum += v; count++; }
+};
 
-    cout << "}";
-}
+// Check that a table still has all the holes the removes left. Only a
+// CloseTable keeps them; its entries vector (BytesWritten) should be as long
+// as it was before the removes.
+template <class Table>
+bool holes_kept(const Table &, size_t) { return true; }
 
-void run_one_speed_test(const char *name)
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+bool holes_kept(const BasicCloseTable<K, V, HashPolicy, Traits, Alloc> &table, size_t written)
 {
-    if (strcmp(name, "InsertLargeTest") == 0)
-        run_speed_test<InsertLargeTest>();
-    else if (strcmp(name, "InsertSmallTest") == 0)
-        run_speed_test<InsertSmallTest>();
-    else if (strcmp(name, "LookupHitTest") == 0)
-        run_speed_test<LookupHitTest>();
-    else if (strcmp(name, "LookupMissTest") == 0)
-        run_speed_test<LookupMissTest>();
-    else if (strcmp(name, "WorklistTest") == 0)
-        run_speed_test<WorklistTest>();
-    else if (strcmp(name, "DeleteTest") == 0)
-        run_speed_test<DeleteTest>();
-    else if (strcmp(name, "LookupAfterDeleteTest") == 0)
-        run_speed_test<LookupAfterDeleteTest>();
-    else {
-        cerr << "No such test: " << name << endl;
-        return;
-    }
-    cout << endl;
+    return table.byte_size(BytesWritten) == written;
 }
 
-void run_all_speed_tests()
-{
-    cout << "{" << endl;
+template <class Table>
+struct IterateAfterDeleteTest : GoodTest {
+    Table table;
+    Value expected_sum;
 
-    cout << "\"InsertLargeTest\": ";
-    run_speed_test<InsertLargeTest>();
-    cout << "," << endl;
+    enum { Size = 51200 };
 
-    cout << "\"InsertSmallTest\": ";
-    run_speed_test<InsertSmallTest>();
-    cout << "," << endl;
+    void setup(size_t) {
+        for (size_t i = 1; i <= Size; i++)
+            table.set(i, i);
+        size_t written = table.byte_size(BytesWritten);
+        expected_sum = 0;
+        for (size_t i = 1; i <= Size; i++) {
+            if (((i - 1) >> 6) & 3)
+                table.remove(i);
+            else
+                expected_sum += i;
+        }
+        if (table.size() != Size / 4 || !holes_kept(table, written))
+            abort();
+    }
 
-    cout << "\"LookupHitTest\": ";
-    run_speed_test<LookupHitTest>();
-    cout << "," << endl;
+    void run(size_t n) {
+        for (size_t done = 0; done < n; ) {
+            SumEntries f = table.for_each(SumEntries());
+            if (f.count != Size / 4 || f.sum != expected_sum)
+                abort();
+            done += f.count;
+        }
+    }
+};
 
-    cout << "\"LookupMissTest\": ";
-    run_speed_test<LookupMissTest>();
-    cout << "," << endl;
+template <class Table>
+struct IterateAfterDeleteIteratorTest : IterateAfterDeleteTest<Table> {
+    void run(size_t n) {
+        for (size_t done = 0; done < n; ) {
+            Value sum = 0;
+            size_t count = 0;
+            for (typename Table::Iterator i = this->table.begin(); !i.done(); ++i) {
+                sum += i.value();
+                count++;
+            }
+            if (count != this->Size / 4 || sum != this->expected_sum)
+                abort();
+            done += count;
+        }
+    }
+};
 
-    cout << "\"WorklistTest\": ";
-    run_speed_test<WorklistTest>();
-    cout << "," << endl;
+// This test inserts keys that are all multiples of 4096, like page-aligned
+// addresses, then looks each one up. With IdentityHash the low 12 bits of
+// every hash code are zero, so the keys pile into a few buckets. It is run
+// once per hash policy; see run_hash_policy_test.
+template <class Table>
+struct StrideTest : SquirrelyTest {
+    Table table;
 
-    cout << "\"DeleteTest\": ";
-    run_speed_test<DeleteTest>();
-    cout << "," << endl;
+    void setup(size_t) {}
 
-    cout << "\"LookupAfterDeleteTest\": ";
-    run_speed_test<LookupAfterDeleteTest>();
+    void run(size_t n) {
+        for (size_t i = 1; i <= n; i++)
+            table.set(Key(i) << 12, i);
+        for (size_t i = 1; i <= n; i++) {
+            if (table.get(Key(i) << 12) != i)
+                abort();
+        }
+    }
+};
 
-    cout << "}" << endl;
-}
+// The bulk-load tests each fill an empty table with n pseudorandom keys:
+// BulkSetTest by calling set() n times, BulkReserveTest the same way but
+// after reserve(n), and BulkAssignTest with one call to assign(). They are
+// run for OpenTable and CloseTable; see run_bulk_load_test.
+template <class Table>
+struct BulkLoadTest : SquirrelyTest {
+    Table table;
+    vector<Key> keys;
+    vector<Value> values;
 
-void measure_space(ByteSizeOption opt)
-{
-#ifdef HAVE_SPARSEHASH
-    DenseTable ht0;
-#endif
-    OpenTable ht1;
+    void setup(size_t n) {
+        keys.resize(n);
+        values.resize(n);
+        Key k = 1;
+        for (size_t i = 0; i < n; i++) {
+            keys[i] = k;
+            values[i] = i;
+            k = k * 1103515245 + 12345;
+        }
+    }
+};
+
+template <class Table>
+struct BulkSetTest : BulkLoadTest<Table> {
+    void run(size_t n) {
+        for (size_t i = 0; i < n; i++)
+            this->table.set(this->keys[i], this->values[i]);
+    }
+};
+
+template <class Table>
+struct BulkReserveTest : BulkLoadTest<Table> {
+    void run(size_t n) {
+        this->table.reserve(n);
+        for (size_t i = 0; i < n; i++)
+            this->table.set(this->keys[i], this->values[i]);
+    }
+};
+
+template <class Table>
+struct BulkAssignTest : BulkLoadTest<Table> {
+    void run(size_t n) {
+        this->table.assign(&this->keys[0], &this->values[0], n);
+    }
+};
+
+// The clone tests each build a table of Size pseudorandom keys in setup(),
+// then copy it over and over, n entries in all, freeing each copy before
+// making the next: CloneSetTest by setting every key in a new table, which
+// was the only way before tables had copy constructors; CloneCopyTest with
+// the copy constructor; and CloneSnapshotTest by taking a CowTable snapshot
+// and then changing one entry, which makes the snapshot copy the table after
+// all. See run_clone_test.
+template <class Table>
+struct CloneTest : SquirrelyTest {
+    enum { Size = 100000 };
+
+    Table table;
+    Table *copy;
+    vector<Key> keys;
+
+    CloneTest() : copy(NULL) {}
+    ~CloneTest() { delete copy; }
+
+    void setup(size_t) {
+        keys.resize(Size);
+        Key k = 1;
+        for (size_t i = 0; i < Size; i++) {
+            keys[i] = k;
+            table.set(k, i);
+            k = k * 1103515245 + 12345;
+        }
+    }
+};
+
+template <class Table>
+struct CloneSetTest : CloneTest<Table> {
+    void run(size_t n) {
+        for (size_t done = 0; done < n; done += this->Size) {
+            delete this->copy;
+            this->copy = new Table;
+            for (size_t i = 0; i < this->Size; i++)
+                this->copy->set(this->keys[i], i);
+        }
+    }
+};
+
+template <class Table>
+struct CloneCopyTest : CloneTest<Table> {
+    void run(size_t n) {
+        for (size_t done = 0; done < n; done += this->Size) {
+            delete this->copy;
+            this->copy = new Table(this->table);
+        }
+    }
+};
+
+template <class Table>
+struct CloneSnapshotTest : CloneTest<Table> {
+    void run(size_t n) {
+        for (size_t done = 0; done < n; done += this->Size) {
+            delete this->copy;
+            this->copy = new Table(this->table);
+            this->copy->set(this->keys[0], 0);
+        }
+    }
+};
+
+// === Mixed workloads
+//
+// MixedTest runs a mix of reads, inserts, updates and deletes described by a
+// Workload, which hashbench -x reads from the command line.
+//
+// The live keys are a sliding window of ids [lo, hi): an insert adds id hi,
+// a delete removes id lo. So the table stays at its starting size as long as
+// inserts and deletes have equal weight. Reads and updates pick a live key by
+// rank, where rank 0 is the newest key, from the chosen distribution. With
+// probability 1 - hit, a read looks for a key that was never inserted
+// instead (picked the same way).
+//
+// Choosing ops and ranks, including Zipf's pow(), happens once, in
+// prepare_workload; run() only walks the result.
+
+struct Workload {
+    enum Distribution { Uniform, Zipf, Hotspot, Sequential };
+    enum Op { Read, ReadMiss, Insert, Update, Delete };
+
+    double read, insert, update, del;   // relative weights of the four ops
+    Distribution dist;
+    double theta;                       // Zipf skew, in (0, 1)
+    double hot_keys, hot_ops;           // hotspot: hot_ops of ops hit hot_keys of keys
+    size_t size;                        // starting (and steady-state) table size
+    double hit;                         // fraction of reads that find their key
+
+    // The precomputed op and rank streams, which run() cycles through.
+    enum { StreamSize = 1 << 20 };
+    vector<uint8_t> ops;
+    vector<uint32_t> ranks;
+
+    Workload()
+        : read(90), insert(5), update(0), del(5), dist(Zipf), theta(0.99),
+          hot_keys(0.2), hot_ops(0.8), size(100000), hit(1) {}
+
+    bool parse(int argc, const char **argv);
+    void prepare();
+};
+
+static Workload workload;
+
+// SplitMix64: a small, fast generator, good enough for picking workloads.
+static uint64_t next_random(uint64_t &state)
+{
+    uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static double next_uniform(uint64_t &state)
+{
+    return double(next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Parse name=value arguments. Return false if any is bad.
+bool Workload::parse(int argc, const char **argv)
+{
+    for (int i = 0; i < argc; i++) {
+        const char *eq = strchr(argv[i], '=');
+        if (!eq)
+            return false;
+        string name(argv[i], eq - argv[i]);
+        const char *value = eq + 1;
+        char *end;
+        double x = strtod(value, &end);
+        bool numeric = *value && !*end && x >= 0;
+
+        if (name == "dist") {
+            if (strcmp(value, "uniform") == 0)
+                dist = Uniform;
+            else if (strcmp(value, "zipf") == 0)
+                dist = Zipf;
+            else if (strcmp(value, "hotspot") == 0)
+                dist = Hotspot;
+            else if (strcmp(value, "sequential") == 0)
+                dist = Sequential;
+            else
+                return false;
+        } else if (!numeric) {
+            return false;
+        } else if (name == "read") {
+            read = x;
+        } else if (name == "insert") {
+            insert = x;
+        } else if (name == "update") {
+            update = x;
+        } else if (name == "delete") {
+            del = x;
+        } else if (name == "theta" && x > 0 && x < 1) {
+            theta = x;
+        } else if (name == "hot" && x > 0 && x < 1) {
+            hot_keys = x;
+        } else if (name == "hotops" && x <= 1) {
+            hot_ops = x;
+        } else if (name == "size" && x >= 1 && x < 4294967296.0) {
+            size = size_t(x);
+        } else if (name == "hit" && x <= 1) {
+            hit = x;
+        } else {
+            return false;
+        }
+    }
+    return read + insert + update + del > 0;
+}
+
+void Workload::prepare()
+{
+    uint64_t state = 1;
+    double total = read + insert + update + del;
+
+    // Zipf sampling as in Gray et al., "Quickly Generating Billion-Record
+    // Synthetic Databases" (SIGMOD 1994), the method YCSB uses.
+    double zetan = 0, zeta2 = 1 + pow(0.5, theta), alpha = 0, eta = 0;
+    if (dist == Zipf) {
+        for (size_t i = 1; i <= size; i++)
+            zetan += pow(double(i), -theta);
+        alpha = 1 / (1 - theta);
+        eta = (1 - pow(2.0 / size, 1 - theta)) / (1 - zeta2 / zetan);
+    }
+    size_t hot = size_t(hot_keys * size);
+    if (hot == 0)
+        hot = 1;
+
+    ops.resize(StreamSize);
+    ranks.resize(StreamSize);
+    for (size_t i = 0; i < StreamSize; i++) {
+        double u = next_uniform(state) * total;
+        if (u < read)
+            ops[i] = next_uniform(state) < hit ? Read : ReadMiss;
+        else if (u < read + insert)
+            ops[i] = Insert;
+        else if (u < read + insert + update)
+            ops[i] = Update;
+        else
+            ops[i] = Delete;
+
+        size_t r;
+        switch (dist) {
+        case Uniform:
+            r = next_random(state) % size;
+            break;
+        case Zipf: {
+            double v = next_uniform(state), uz = v * zetan;
+            if (uz < 1)
+                r = 0;
+            else if (uz < zeta2)
+                r = 1;
+            else
+                r = size_t(size * pow(eta * v - eta + 1, alpha));
+            break;
+        }
+        case Hotspot:
+            if (next_uniform(state) < hot_ops || hot == size)
+                r = next_random(state) % hot;
+            else
+                r = hot + next_random(state) % (size - hot);
+            break;
+        default:  // Sequential
+            r = i % size;
+            break;
+        }
+        ranks[i] = uint32_t(r < size ? r : size - 1);
+    }
+}
+
+// An invertible mix of a key id, so that live keys are scattered (odd ids)
+// and keys that are never inserted are distinct from all of them (even ids).
+static Key workload_key(uint64_t id)
+{
+    uint64_t x = id;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+template <class Table>
+struct MixedTest : GoodTest {
+    Table table;
+    uint64_t lo, hi;        // live key ids
+    Value sum;              // of everything read, so reads aren't optimized away
+
+    void setup(size_t) {
+        lo = 0;
+        hi = workload.size;
+        for (uint64_t id = lo; id < hi; id++)
+            table.set(workload_key(2 * id + 1), id);
+        sum = 0;
+    }
+
+    void run(size_t n) {
+        const uint8_t *ops = &workload.ops[0];
+        const uint32_t *ranks = &workload.ranks[0];
+        size_t seq = 0;
+        for (size_t i = 0; i < n; i++) {
+            size_t j = i & (Workload::StreamSize - 1);
+            uint64_t live = hi - lo;
+            uint8_t op = live ? ops[j] : uint8_t(Workload::Insert);
+            uint64_t rank = workload.dist == Workload::Sequential ? seq++ : ranks[j];
+            if (rank >= live)
+                rank = live ? rank % live : 0;
+            uint64_t id = hi - 1 - rank;    // not used by Insert or Delete
+
+            switch (op) {
+            case Workload::Read:
+                sum += table.get(workload_key(2 * id + 1));
+                break;
+            case Workload::ReadMiss:
+                sum += table.get(workload_key(2 * id + 2));
+                break;
+            case Workload::Insert:
+                table.set(workload_key(2 * hi + 1), i);
+                hi++;
+                break;
+            case Workload::Update:
+                table.set(workload_key(2 * id + 1), i);
+                break;
+            case Workload::Delete:
+                if (!table.remove(workload_key(2 * lo + 1)))
+                    abort();
+                lo++;
+                break;
+            }
+        }
+    }
+};
+
+template <template <class> class Test>
+void run_speed_test()
+{
+    cout << '{' << endl;
+
+#ifdef HAVE_SPARSEHASH
+    cout << "\t\"DenseTable\": ";
+    run_time_trials<Test<DenseTable> >();
+    cout << ',' << endl;
+#endif
+
+    cout << "\t\"OpenTable\": ";
+    run_time_trials<Test<OpenTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"RobinHoodTable\": ";
+    run_time_trials<Test<RobinHoodTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"CloseTable\": ";
+    run_time_trials<Test<CloseTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"IncrementalCloseTable\": ";
+    run_time_trials<Test<IncrementalCloseTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"SwissCloseTable\": ";
+    run_time_trials<Test<SwissCloseTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"CompactCloseTable\": ";
+    run_time_trials<Test<CompactCloseTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"BucketCloseTable\": ";
+    run_time_trials<Test<BucketCloseTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"InlineOpenTable\": ";
+    run_time_trials<Test<InlineOpenTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"InlineCloseTable\": ";
+    run_time_trials<Test<InlineCloseTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"OpenSet\": ";
+    run_time_trials<Test<SetAsMap<OpenSet> > >();
+    cout << ',' << endl;
+
+    cout << "\t\"CloseSet\": ";
+    run_time_trials<Test<SetAsMap<CloseSet> > >();
+    cout << endl;
+
+    cout << "}";
+}
+
+// Like run_speed_test, but run OpenTable and CloseTable with each hash policy.
+template <template <class> class Test>
+void run_hash_policy_test()
+{
+    cout << '{' << endl;
+
+    cout << "\t\"OpenTable/IdentityHash\": ";
+    run_time_trials<Test<BasicOpenTable<Key, Value, IdentityHash> > >();
+    cout << ',' << endl;
+
+    cout << "\t\"OpenTable/FibonacciHash\": ";
+    run_time_trials<Test<BasicOpenTable<Key, Value, FibonacciHash> > >();
+    cout << ',' << endl;
+
+    cout << "\t\"OpenTable/MixHash\": ";
+    run_time_trials<Test<BasicOpenTable<Key, Value, MixHash> > >();
+    cout << ',' << endl;
+
+    cout << "\t\"CloseTable/IdentityHash\": ";
+    run_time_trials<Test<BasicCloseTable<Key, Value, IdentityHash> > >();
+    cout << ',' << endl;
+
+    cout << "\t\"CloseTable/FibonacciHash\": ";
+    run_time_trials<Test<BasicCloseTable<Key, Value, FibonacciHash> > >();
+    cout << ',' << endl;
+
+    cout << "\t\"CloseTable/MixHash\": ";
+    run_time_trials<Test<BasicCloseTable<Key, Value, MixHash> > >();
+    cout << endl;
+
+    cout << "}";
+}
+
+// Like run_speed_test, but only for the tables that support batched lookups,
+// with and without batching.
+template <template <class> class Test>
+void run_batch_speed_test()
+{
+    cout << '{' << endl;
+
+    cout << "\t\"OpenTable\": ";
+    run_time_trials<Test<Unbatched<OpenTable> > >();
+    cout << ',' << endl;
+
+    cout << "\t\"OpenTable/get_many\": ";
+    run_time_trials<Test<OpenTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"CloseTable\": ";
+    run_time_trials<Test<Unbatched<CloseTable> > >();
+    cout << ',' << endl;
+
+    cout << "\t\"CloseTable/get_many\": ";
+    run_time_trials<Test<CloseTable> >();
+    cout << endl;
+
+    cout << "}";
+}
+
+// Loading a table with set(), with reserve() and set(), and with assign().
+void run_bulk_load_test()
+{
+    cout << '{' << endl;
+
+    cout << "\t\"OpenTable\": ";
+    run_time_trials<BulkSetTest<OpenTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"OpenTable/reserve\": ";
+    run_time_trials<BulkReserveTest<OpenTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"OpenTable/assign\": ";
+    run_time_trials<BulkAssignTest<OpenTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"CloseTable\": ";
+    run_time_trials<BulkSetTest<CloseTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"CloseTable/reserve\": ";
+    run_time_trials<BulkReserveTest<CloseTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"CloseTable/assign\": ";
+    run_time_trials<BulkAssignTest<CloseTable> >();
+    cout << endl;
+
+    cout << "}";
+}
+
+// IterateAfterDeleteTest: for_each on OpenTable and CloseTable, and a
+// CloseTable::Iterator.
+void run_iterate_test()
+{
+    cout << '{' << endl;
+
+    cout << "\t\"OpenTable\": ";
+    run_time_trials<IterateAfterDeleteTest<OpenTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"CloseTable\": ";
+    run_time_trials<IterateAfterDeleteTest<CloseTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"CloseTable/iterator\": ";
+    run_time_trials<IterateAfterDeleteIteratorTest<CloseTable> >();
+    cout << endl;
+
+    cout << "}";
+}
+
+// Copying tables, by set(), by the copy constructor, and by a CowTable
+// snapshot followed by one write.
+void run_clone_test()
+{
+    cout << '{' << endl;
+
+    cout << "\t\"OpenTable/set\": ";
+    run_time_trials<CloneSetTest<OpenTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"OpenTable/copy\": ";
+    run_time_trials<CloneCopyTest<OpenTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"CowOpenTable/snapshot\": ";
+    run_time_trials<CloneSnapshotTest<CowOpenTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"CloseTable/set\": ";
+    run_time_trials<CloneSetTest<CloseTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"CloseTable/copy\": ";
+    run_time_trials<CloneCopyTest<CloseTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"CowCloseTable/snapshot\": ";
+    run_time_trials<CloneSnapshotTest<CowCloseTable> >();
+    cout << endl;
+
+    cout << "}";
+}
+
+// How much memory snapshots of a table of snapshot_test_size entries take:
+// full copies, CowTable snapshots nobody writes to, and CowTable snapshots
+// that each get one set() afterward. For each, print a list of
+// [snapshots, bytes allocated], up to max_snapshots.
+const size_t snapshot_test_size = 1000000;
+
+template <class Table, class Snapshot>
+void run_snapshot_memory_trials(int max_snapshots, bool write)
+{
+    Table table;
+    for (size_t i = 1; i <= snapshot_test_size; i++)
+        table.set(i, i);
+
+    vector<Snapshot *> snapshots;
+    snapshots.reserve(max_snapshots);
+    AllocCounts before = current_alloc_counts();
+    cout << "[\n";
+    for (int i = 1; i <= max_snapshots; i++) {
+        snapshots.push_back(new Snapshot(table));
+        if (write)
+            snapshots.back()->set(i, 0);
+        AllocCounts after = current_alloc_counts();
+        cout << "\t\t[" << i << ", " << after.bytes - before.bytes << (i < max_snapshots ? "]," : "]") << endl;
+    }
+    cout << "\t]";
+    for (size_t i = 0; i < snapshots.size(); i++)
+        delete snapshots[i];
+}
+
+void run_snapshot_memory_test(int max_snapshots)
+{
+    cout << '{' << endl;
+
+    cout << "\t\"OpenTable/copy\": ";
+    run_snapshot_memory_trials<OpenTable, OpenTable>(max_snapshots, false);
+    cout << ',' << endl;
+
+    cout << "\t\"CowOpenTable\": ";
+    run_snapshot_memory_trials<CowOpenTable, CowOpenTable>(max_snapshots, false);
+    cout << ',' << endl;
+
+    cout << "\t\"CowOpenTable/written\": ";
+    run_snapshot_memory_trials<CowOpenTable, CowOpenTable>(max_snapshots, true);
+    cout << ',' << endl;
+
+    cout << "\t\"CloseTable/copy\": ";
+    run_snapshot_memory_trials<CloseTable, CloseTable>(max_snapshots, false);
+    cout << ',' << endl;
+
+    cout << "\t\"CowCloseTable\": ";
+    run_snapshot_memory_trials<CowCloseTable, CowCloseTable>(max_snapshots, false);
+    cout << ',' << endl;
+
+    cout << "\t\"CowCloseTable/written\": ";
+    run_snapshot_memory_trials<CowCloseTable, CowCloseTable>(max_snapshots, true);
+    cout << endl;
+
+    cout << '}' << endl;
+}
+
+// InsertSmallTest with each allocator policy.
+void run_allocator_speed_test()
+{
+    cout << '{' << endl;
+
+    cout << "\t\"OpenTable\": ";
+    run_time_trials<InsertSmallTest<OpenTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"OpenTable/PoolAllocator\": ";
+    run_time_trials<InsertSmallTest<PoolOpenTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"OpenTable/ArenaAllocator\": ";
+    run_time_trials<InsertSmallArenaTest<ArenaOpenTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"CloseTable\": ";
+    run_time_trials<InsertSmallTest<CloseTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"CloseTable/PoolAllocator\": ";
+    run_time_trials<InsertSmallTest<PoolCloseTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"CloseTable/ArenaAllocator\": ";
+    run_time_trials<InsertSmallArenaTest<ArenaCloseTable> >();
+    cout << endl;
+
+    cout << "}";
+}
+
+void run_one_speed_test(const char *name)
+{
+    if (strcmp(name, "InsertLargeTest") == 0)
+        run_speed_test<InsertLargeTest>();
+    else if (strcmp(name, "InsertSmallTest") == 0)
+        run_speed_test<InsertSmallTest>();
+    else if (strcmp(name, "InsertSmallAllocatorTest") == 0)
+        run_allocator_speed_test();
+    else if (strcmp(name, "BulkLoadTest") == 0)
+        run_bulk_load_test();
+    else if (strcmp(name, "CloneTest") == 0)
+        run_clone_test();
+    else if (strcmp(name, "LookupHitTest") == 0)
+        run_speed_test<LookupHitTest>();
+    else if (strcmp(name, "LookupMissTest") == 0)
+        run_speed_test<LookupMissTest>();
+    else if (strcmp(name, "LookupHitBatchTest") == 0)
+        run_batch_speed_test<LookupHitBatchTest>();
+    else if (strcmp(name, "LookupMissBatchTest") == 0)
+        run_batch_speed_test<LookupMissBatchTest>();
+    else if (strcmp(name, "WorklistTest") == 0)
+        run_speed_test<WorklistTest>();
+    else if (strcmp(name, "DeleteTest") == 0)
+        run_speed_test<DeleteTest>();
+    else if (strcmp(name, "LookupAfterDeleteTest") == 0)
+        run_speed_test<LookupAfterDeleteTest>();
+    else if (strcmp(name, "IterateAfterDeleteTest") == 0)
+        run_iterate_test();
+    else if (strcmp(name, "StrideTest") == 0)
+        run_hash_policy_test<StrideTest>();
+    else {
+        cerr << "No such test: " << name << endl;
+        return;
+    }
+    cout << endl;
+}
+
+void run_all_speed_tests()
+{
+    cout << "{" << endl;
+
+    cout << "\"InsertLargeTest\": ";
+    run_speed_test<InsertLargeTest>();
+    cout << "," << endl;
+
+    cout << "\"InsertSmallTest\": ";
+    run_speed_test<InsertSmallTest>();
+    cout << "," << endl;
+
+    cout << "\"InsertSmallAllocatorTest\": ";
+    run_allocator_speed_test();
+    cout << "," << endl;
+
+    cout << "\"BulkLoadTest\": ";
+    run_bulk_load_test();
+    cout << "," << endl;
+
+    cout << "\"CloneTest\": ";
+    run_clone_test();
+    cout << "," << endl;
+
+    cout << "\"LookupHitTest\": ";
+    run_speed_test<LookupHitTest>();
+    cout << "," << endl;
+
+    cout << "\"LookupMissTest\": ";
+    run_speed_test<LookupMissTest>();
+    cout << "," << endl;
+
+    cout << "\"LookupHitBatchTest\": ";
+    run_batch_speed_test<LookupHitBatchTest>();
+    cout << "," << endl;
+
+    cout << "\"LookupMissBatchTest\": ";
+    run_batch_speed_test<LookupMissBatchTest>();
+    cout << "," << endl;
+
+    cout << "\"WorklistTest\": ";
+    run_speed_test<WorklistTest>();
+    cout << "," << endl;
+
+    cout << "\"DeleteTest\": ";
+    run_speed_test<DeleteTest>();
+    cout << "," << endl;
+
+    cout << "\"LookupAfterDeleteTest\": ";
+    run_speed_test<LookupAfterDeleteTest>();
+    cout << "," << endl;
+
+    cout << "\"IterateAfterDeleteTest\": ";
+    run_iterate_test();
+    cout << "," << endl;
+
+    cout << "\"StrideTest\": ";
+    run_hash_policy_test<StrideTest>();
+
+    cout << "}" << endl;
+}
+
+// hashbench -x [name=value ...]: run MixedTest.
+bool run_mixed_test(int argc, const char **argv)
+{
+    if (!workload.parse(argc, argv))
+        return false;
+    workload.prepare();
+
+    cout << "{" << endl;
+    cout << "\"MixedTest\": ";
+    run_speed_test<MixedTest>();
+    cout << "}" << endl;
+    return true;
+}
+
+
+#ifdef HAVE_MMAP
+// === Replaying traces
+//
+// hashbench --replay FILE plays a trace file (see TraceWriter in tables.h)
+// against each table implementation. The file is mapped, not read, and every
+// page of it is touched before the clock starts, so the timed loop does
+// nothing but switch on records that are already in memory.
+
+struct Trace {
+    const TraceRecord *records;
+    uint64_t count;
+    uint32_t table_count;
+    uint64_t expected;      // the checksum replay() should return
+};
+
+const int replay_trials = 5;
+
+// Replay a trace against tables[0..trace.table_count). Return a checksum of
+// the results: the sum of the values got, plus one for each has or remove
+// that returned true.
+template <class Table>
+uint64_t replay(Table *tables, const Trace &trace)
+{
+    uint64_t checksum = 0;
+    for (const TraceRecord *r = trace.records, *end = r + trace.count; r != end; r++) {
+        Table &table = tables[r->table];
+        switch (r->op) {
+        case TraceGet: checksum += table.get(r->key); break;
+        case TraceHas: checksum += table.has(r->key); break;
+        case TraceSet: table.set(r->key, r->value); break;
+        case TraceRemove: checksum += table.remove(r->key); break;
+        }
+    }
+    return checksum;
+}
+
+// Like run_time_trials, but every trial is the whole trace, with new tables.
+template <class Table>
+void run_replay_trials(const Trace &trace)
+{
+    cout << "[\n";
+    for (int i = 0; i < replay_trials; i++) {
+        Table *tables = new Table[trace.table_count];
+        AllocCounts before = current_alloc_counts();
+        Stopwatch watch;
+        watch.start();
+        uint64_t checksum = replay(tables, trace);
+        double dt = watch.elapsed();
+        AllocCounts after = current_alloc_counts();
+        delete[] tables;
+
+        if (checksum != trace.expected)
+            cerr << "hashbench: warning: replay results don't match the ones recorded" << endl;
+        cout << "\t\t[" << trace.count << ", " << dt << ", " << after.allocations - before.allocations
+             << ", " << after.bytes - before.bytes << (i < replay_trials - 1 ? "]," : "]") << endl;
+    }
+    cout << "\t]";
+}
+
+// Map a trace file and check it over. Return false, with a message on
+// stderr, if it's no good.
+bool load_trace(const char *filename, Trace *trace)
+{
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        cerr << filename << ": " << strerror(errno) << endl;
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    size_t size = size_t(st.st_size);
+    void *p = size < sizeof(TraceHeader) ? MAP_FAILED : mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        cerr << filename << ": not a trace file" << endl;
+        return false;
+    }
+
+    const TraceHeader *header = static_cast<const TraceHeader *>(p);
+    size_t body = size - sizeof(TraceHeader);
+    if (!header->valid() || body % sizeof(TraceRecord) != 0 || body / sizeof(TraceRecord) != header->count) {
+        cerr << filename << ": not a trace file, or the wrong version" << endl;
+        munmap(p, size);
+        return false;
+    }
+    trace->records = reinterpret_cast<const TraceRecord *>(header + 1);
+    trace->count = header->count;
+    trace->table_count = header->table_count;
+
+    // Check every record (which also faults in every page) and work out the
+    // checksum.
+    trace->expected = 0;
+    for (uint64_t i = 0; i < trace->count; i++) {
+        const TraceRecord &r = trace->records[i];
+        if (r.op > TraceRemove || r.table >= trace->table_count) {
+            cerr << filename << ": bad record " << i << endl;
+            munmap(p, size);
+            return false;
+        }
+        if (r.op != TraceSet)
+            trace->expected += r.value;
+    }
+    return true;
+}
+
+void run_replay(const char *filename)
+{
+    Trace trace;
+    if (!load_trace(filename, &trace))
+        exit(1);
+
+    cout << '{' << endl;
+
+#ifdef HAVE_SPARSEHASH
+    cout << "\t\"DenseTable\": ";
+    run_replay_trials<DenseTable>(trace);
+    cout << ',' << endl;
+#endif
+
+    cout << "\t\"OpenTable\": ";
+    run_replay_trials<OpenTable>(trace);
+    cout << ',' << endl;
+
+    cout << "\t\"RobinHoodTable\": ";
+    run_replay_trials<RobinHoodTable>(trace);
+    cout << ',' << endl;
+
+    cout << "\t\"CloseTable\": ";
+    run_replay_trials<CloseTable>(trace);
+    cout << ',' << endl;
+
+    cout << "\t\"IncrementalCloseTable\": ";
+    run_replay_trials<IncrementalCloseTable>(trace);
+    cout << ',' << endl;
+
+    cout << "\t\"SwissCloseTable\": ";
+    run_replay_trials<SwissCloseTable>(trace);
+    cout << ',' << endl;
+
+    cout << "\t\"CompactCloseTable\": ";
+    run_replay_trials<CompactCloseTable>(trace);
+    cout << ',' << endl;
+
+    cout << "\t\"BucketCloseTable\": ";
+    run_replay_trials<BucketCloseTable>(trace);
+    cout << ',' << endl;
+
+    cout << "\t\"InlineOpenTable\": ";
+    run_replay_trials<InlineOpenTable>(trace);
+    cout << ',' << endl;
+
+    cout << "\t\"InlineCloseTable\": ";
+    run_replay_trials<InlineCloseTable>(trace);
+    cout << endl;
+
+    cout << "}" << endl;
+}
+
+// === Measuring startup time
+//
+// hashbench -f [n] measures how long it takes to get a table of n entries
+// ready to use: either by building it with set(), or by opening a file
+// written earlier by MappedCloseTable::save or MappedOpenTable::save. Each
+// data point is [n, seconds to load, seconds for the first get, seconds for
+// the next 1000 gets]. The mapped tables pay their page faults in the gets.
+//
+// The file has just been written, so it is in the page cache. This measures
+// a warm start, not reading the file from disk.
+
+const char *mapped_filename = "hashbench-mapped.tmp";
+const int startup_trials = 3;
+
+struct StartupTimes {
+    double load, first, more;
+};
+
+template <class Table>
+void time_first_lookups(const Table &table, const vector<Key> &keys, StartupTimes *times)
+{
+    Stopwatch watch;
+    watch.start();
+    Value sum = table.get(keys[keys.size() / 2]);
+    times->first = watch.elapsed();
+
+    size_t step = keys.size() / 1000 + 1;
+    watch.start();
+    for (size_t i = 0; i < keys.size(); i += step)
+        sum += table.get(keys[i]);
+    times->more = watch.elapsed();
+
+    if (sum == 0)
+        cerr << "hashbench: warning: lookups failed" << endl;
+}
+
+void print_startup_point(size_t n, const StartupTimes &times, int trial)
+{
+    cout << "\t\t[" << n << ", " << times.load << ", " << times.first << ", " << times.more
+         << (trial < startup_trials - 1 ? "]," : "]") << endl;
+}
+
+template <class Table>
+void fill_startup_table(Table &table, const vector<Key> &keys)
+{
+    for (size_t i = 0; i < keys.size(); i++)
+        table.set(keys[i], keys[i]);
+}
+
+template <class Table>
+void run_set_startup_trials(const vector<Key> &keys)
+{
+    cout << "[\n";
+    for (int i = 0; i < startup_trials; i++) {
+        StartupTimes times;
+        Stopwatch watch;
+        watch.start();
+        Table *table = new Table;
+        fill_startup_table(*table, keys);
+        times.load = watch.elapsed();
+        time_first_lookups(*table, keys, &times);
+        delete table;
+        print_startup_point(keys.size(), times, i);
+    }
+    cout << "\t]";
+}
+
+template <class Mapped, class Table>
+void run_mapped_startup_trials(const vector<Key> &keys)
+{
+    {
+        Table table;
+        fill_startup_table(table, keys);
+        if (!Mapped::save(table, mapped_filename)) {
+            cerr << mapped_filename << ": " << strerror(errno) << endl;
+            exit(1);
+        }
+    }
+
+    cout << "[\n";
+    for (int i = 0; i < startup_trials; i++) {
+        StartupTimes times;
+        Stopwatch watch;
+        watch.start();
+        Mapped *table = new Mapped;
+        if (!table->open(mapped_filename)) {
+            cerr << mapped_filename << ": can't open the file just saved" << endl;
+            exit(1);
+        }
+        times.load = watch.elapsed();
+        time_first_lookups(*table, keys, &times);
+        delete table;
+        print_startup_point(keys.size(), times, i);
+    }
+    cout << "\t]";
+    unlink(mapped_filename);
+}
+
+void run_startup_test(size_t n)
+{
+    vector<Key> keys(n);
+    Key k = 1;
+    for (size_t i = 0; i < n; i++) {
+        keys[i] = k;
+        k = k * 1103515245 + 12345;
+    }
+
+    cout << '{' << endl;
+
+    cout << "\t\"CloseTable/set\": ";
+    run_set_startup_trials<CloseTable>(keys);
+    cout << ',' << endl;
+
+    cout << "\t\"MappedCloseTable\": ";
+    run_mapped_startup_trials<MappedCloseTable, CloseTable>(keys);
+    cout << ',' << endl;
+
+    cout << "\t\"OpenTable/set\": ";
+    run_set_startup_trials<OpenTable>(keys);
+    cout << ',' << endl;
+
+    cout << "\t\"MappedOpenTable\": ";
+    run_mapped_startup_trials<MappedOpenTable, OpenTable>(keys);
+    cout << endl;
+
+    cout << '}' << endl;
+}
+
+// === Tables past 2^32 entries
+//
+// hashbench --large [n] fills a table with keys 1 to n (default 5 billion,
+// which is past 2^32), then does LargeProbes gets of random keys that are
+// there and LargeProbes gets of keys that aren't, checking every answer. It
+// runs HugeOpenTable and HugeCloseTable, whose big arrays are backed by
+// transparent huge pages, and then OpenTable and CloseTable for comparison.
+// Each point is [n, seconds to fill, seconds for the hits, seconds for the
+// misses].
+//
+// This is for a box with a lot of memory. At the default size an OpenTable
+// is 128 GB, and half as much again while it rehashes; a CloseTable is about
+// the same. The huge pages only help if transparent huge pages are enabled
+// (/sys/kernel/mm/transparent_hugepage/enabled says "always" or "madvise").
+
+enum { LargeProbes = 10000000 };
+
+template <class Table>
+void run_large_trial(size_t n)
+{
+    Table *table = new Table;
+    Stopwatch watch;
+    watch.start();
+    for (size_t i = 1; i <= n; i++)
+        table->set(i, i);
+    double fill = watch.elapsed();
+    if (table->size() != n) {
+        cerr << "hashbench: table has " << table->size() << " entries, expected " << n << endl;
+        exit(1);
+    }
+
+    uint64_t state = 1;
+    watch.start();
+    for (size_t i = 0; i < LargeProbes; i++) {
+        Key k = next_random(state) % n + 1;
+        if (table->get(k) != k)
+            abort();
+    }
+    double hits = watch.elapsed();
+
+    watch.start();
+    for (size_t i = 0; i < LargeProbes; i++) {
+        if (table->has(n + 1 + next_random(state) % n))
+            abort();
+    }
+    double misses = watch.elapsed();
+
+    delete table;
+    cout << "[" << n << ", " << fill << ", " << hits << ", " << misses << "]";
+}
+
+void run_large_test(size_t n)
+{
+    cout << '{' << endl;
+
+    cout << "\t\"HugeOpenTable\": ";
+    run_large_trial<HugeOpenTable>(n);
+    cout << ',' << endl;
+
+    cout << "\t\"HugeCloseTable\": ";
+    run_large_trial<HugeCloseTable>(n);
+    cout << ',' << endl;
+
+    cout << "\t\"OpenTable\": ";
+    run_large_trial<OpenTable>(n);
+    cout << ',' << endl;
+
+    cout << "\t\"CloseTable\": ";
+    run_large_trial<CloseTable>(n);
+    cout << endl;
+
+    cout << '}' << endl;
+}
+#endif  // HAVE_MMAP
+
+#ifdef HAVE_CLOCK_GETTIME
+// === Code for measuring latency
+//
+// The speed tests report the mean time per operation, which hides the few
+// operations that trigger a rehash. The latency tests time every operation
+// separately and report percentiles. Each time includes the overhead of
+// reading the clock twice, which is reported too.
+
+// A histogram of latencies in nanoseconds, HDR-style: values below 2^(S+1)
+// each get their own bucket; above that, each power of two is split into 2^S
+// buckets, so a value is known to within 1/2^S (about 3%) of itself.
+class LatencyHistogram {
+    enum { S = 5, NumBuckets = (64 - S + 1) << S };
+
+    uint64_t counts[NumBuckets];
+    uint64_t total;
+    uint64_t max_value;
+
+    static int bucket_for(uint64_t v) {
+        if (v < (uint64_t(1) << (S + 1)))
+            return int(v);
+        int msb = 63;
+#ifdef __GNUC__
+        msb = 63 - __builtin_clzll(v);
+#else
+        while (!(v >> msb))
+            msb--;
+#endif
+        int shift = msb - S;
+        return (shift << S) + int(v >> shift);
+    }
+
+public:
+    LatencyHistogram() : total(0), max_value(0) {
+        memset(counts, 0, sizeof(counts));
+    }
+
+    void record(uint64_t v) {
+        counts[bucket_for(v)]++;
+        total++;
+        if (v > max_value)
+            max_value = v;
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t max() const { return max_value; }
+
+    // The largest value that lands in bucket i.
+    static uint64_t bucket_limit(int i) {
+        if (i < (1 << (S + 1)))
+            return uint64_t(i);
+        int shift = (i >> S) - 1;
+        uint64_t mantissa = uint64_t(i) - (uint64_t(shift) << S);
+        return ((mantissa + 1) << shift) - 1;
+    }
+
+    // The smallest bucket limit with at least fraction p of the values at or
+    // below it (but never more than the actual maximum).
+    uint64_t percentile(double p) const {
+        uint64_t need = uint64_t(ceil(p * double(total)));
+        uint64_t seen = 0;
+        for (int i = 0; i < NumBuckets; i++) {
+            seen += counts[i];
+            if (seen >= need && seen > 0)
+                return bucket_limit(i) < max_value ? bucket_limit(i) : max_value;
+        }
+        return max_value;
+    }
+
+    // Write the CDF as a JSON list of [nanoseconds, fraction at or below],
+    // one point per nonempty bucket.
+    void write_cdf(ostream &out) const {
+        out << '[';
+        uint64_t seen = 0;
+        bool first = true;
+        for (int i = 0; i < NumBuckets; i++) {
+            if (counts[i] == 0)
+                continue;
+            seen += counts[i];
+            uint64_t limit = bucket_limit(i) < max_value ? bucket_limit(i) : max_value;
+            out << (first ? "[" : ", [") << limit << ", " << double(seen) / double(total) << ']';
+            first = false;
+        }
+        out << ']';
+    }
+};
+
+// Time each call to f(i), for i in [0, n), into h.
+template <class F>
+void time_each(F &f, size_t n, LatencyHistogram &h)
+{
+    for (size_t i = 0; i < n; i++) {
+        uint64_t t0 = Stopwatch::nanoseconds();
+        f(i);
+        h.record(Stopwatch::nanoseconds() - t0);
+    }
+}
+
+// The latency tests. Each one has setup() and run(LatencyHistogram &), and
+// works on a table big enough to rehash many times.
+
+const size_t latency_test_size = size_t(1) << 20;
+
+// Insert into a growing table. This is where the rehash spikes are.
+template <class Table>
+struct InsertLatencyTest {
+    Table table;
+    Key k;
+
+    void setup() { k = 1; }
+    void operator()(size_t) {
+        table.set(k, k);
+        k = k * 1103515245 + 12345;
+    }
+    void run(LatencyHistogram &h) { time_each(*this, latency_test_size, h); }
+};
+
+// Look up every key in a full table.
+template <class Table>
+struct LookupLatencyTest {
+    Table table;
+    size_t errors;
+
+    void setup() {
+        for (size_t i = 0; i < latency_test_size; i++)
+            table.set(i + 1, i);
+        errors = 0;
+    }
+    void operator()(size_t i) {
+        if (table.get(i + 1) != i)
+            errors++;
+    }
+    void run(LatencyHistogram &h) {
+        time_each(*this, latency_test_size, h);
+        if (errors)
+            abort();
+    }
+};
+
+// Remove every key from a full table, which shrinks it several times.
+template <class Table>
+struct DeleteLatencyTest {
+    Table table;
+
+    void setup() {
+        for (size_t i = 0; i < latency_test_size; i++)
+            table.set(i + 1, i);
+    }
+    void operator()(size_t i) {
+        if (!table.remove(i + 1))
+            abort();
+    }
+    void run(LatencyHistogram &h) { time_each(*this, latency_test_size, h); }
+};
+
+// Run one latency test and write its results as a JSON object.
+template <class Test>
+void run_latency_trial()
+{
+    Test *test = new Test;
+    test->setup();
+    LatencyHistogram h;
+    test->run(h);
+    delete test;
+
+    // Estimate the clock overhead: the smallest of many empty intervals.
+    uint64_t overhead = uint64_t(-1);
+    for (int i = 0; i < 1000; i++) {
+        uint64_t t0 = Stopwatch::nanoseconds();
+        uint64_t dt = Stopwatch::nanoseconds() - t0;
+        if (dt < overhead)
+            overhead = dt;
+    }
+
+    cout << "{\"count\": " << h.count()
+         << ", \"p50\": " << h.percentile(0.5)
+         << ", \"p99\": " << h.percentile(0.99)
+         << ", \"p99.9\": " << h.percentile(0.999)
+         << ", \"max\": " << h.max()
+         << ", \"clock_overhead\": " << overhead
+         << ",\n\t\t\"cdf\": ";
+    h.write_cdf(cout);
+    cout << '}';
+}
+
+template <template <class> class Test>
+void run_latency_test()
+{
+    cout << '{' << endl;
+
+#ifdef HAVE_SPARSEHASH
+    cout << "\t\"DenseTable\": ";
+    run_latency_trial<Test<DenseTable> >();
+    cout << ',' << endl;
+#endif
+
+    cout << "\t\"OpenTable\": ";
+    run_latency_trial<Test<OpenTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"RobinHoodTable\": ";
+    run_latency_trial<Test<RobinHoodTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"CloseTable\": ";
+    run_latency_trial<Test<CloseTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"IncrementalCloseTable\": ";
+    run_latency_trial<Test<IncrementalCloseTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"SwissCloseTable\": ";
+    run_latency_trial<Test<SwissCloseTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"CompactCloseTable\": ";
+    run_latency_trial<Test<CompactCloseTable> >();
+    cout << ',' << endl;
+
+    cout << "\t\"BucketCloseTable\": ";
+    run_latency_trial<Test<BucketCloseTable> >();
+    cout << endl;
+
+    cout << "}";
+}
+
+// Write the results of one latency test, or all of them if name is NULL.
+void run_latency_tests(const char *name)
+{
+    if (name == NULL) {
+        cout << "{" << endl;
+        cout << "\"InsertLatencyTest\": ";
+        run_latency_test<InsertLatencyTest>();
+        cout << "," << endl;
+        cout << "\"LookupLatencyTest\": ";
+        run_latency_test<LookupLatencyTest>();
+        cout << "," << endl;
+        cout << "\"DeleteLatencyTest\": ";
+        run_latency_test<DeleteLatencyTest>();
+        cout << "}" << endl;
+    } else if (strcmp(name, "InsertLatencyTest") == 0) {
+        run_latency_test<InsertLatencyTest>();
+        cout << endl;
+    } else if (strcmp(name, "LookupLatencyTest") == 0) {
+        run_latency_test<LookupLatencyTest>();
+        cout << endl;
+    } else if (strcmp(name, "DeleteLatencyTest") == 0) {
+        run_latency_test<DeleteLatencyTest>();
+        cout << endl;
+    } else {
+        cerr << "No such test: " << name << endl;
+    }
+}
+#endif  // HAVE_CLOCK_GETTIME
+
+void measure_space(ByteSizeOption opt)
+{
+#ifdef HAVE_SPARSEHASH
+    DenseTable ht0;
+#endif
+    OpenTable ht1;
     CloseTable ht2;
+    SwissCloseTable ht3;
+    IncrementalCloseTable ht4;
+    CompactCloseTable ht5;
+    RobinHoodTable ht6;
+    InlineOpenTable ht7;
+    InlineCloseTable ht8;
+    BucketCloseTable ht9;
+    OpenSet ht10;
+    CloseSet ht11;
 
     for (int i = 0; i < 100000; i++) {
         cout << i << '\t'
@@ -365,19 +2254,397 @@ void measure_space(ByteSizeOption opt)
 #else
              << 1 << '\t'
 #endif
-             << ht1.byte_size(opt) << '\t' << ht2.byte_size(opt) << endl;
+             << ht1.byte_size(opt) << '\t' << ht2.byte_size(opt) << '\t'
+             << ht3.byte_size(opt) << '\t' << ht4.byte_size(opt) << '\t'
+             << ht5.byte_size(opt) << '\t' << ht6.byte_size(opt) << '\t'
+             << ht7.byte_size(opt) << '\t' << ht8.byte_size(opt) << '\t'
+             << ht9.byte_size(opt) << '\t' << ht10.byte_size(opt) << '\t'
+             << ht11.byte_size(opt);
+        // With -m, one more column: CloseTable's high-water mark, which
+        // counts both the old and new arrays during each rehash.
+        if (opt == BytesAllocated)
+            cout << '\t' << ht2.byte_size(BytesPeak);
+        cout << endl;
 
 #ifdef HAVE_SPARSEHASH
         ht0.set(i + 1, i);
 #endif
         ht1.set(i + 1, i);
         ht2.set(i + 1, i);
+        ht3.set(i + 1, i);
+        ht4.set(i + 1, i);
+        ht5.set(i + 1, i);
+        ht6.set(i + 1, i);
+        ht7.set(i + 1, i);
+        ht8.set(i + 1, i);
+        ht9.set(i + 1, i);
+        ht10.set(i + 1, true);
+        ht11.set(i + 1, true);
+    }
+}
+
+#ifdef HAVE_PTHREADS
+
+// === Code for measuring multithreaded throughput
+//
+// A thread test has a method run_thread(i), which is called on each of
+// several threads, with i = 0, 1, 2, .... It does operations until stopped()
+// returns true and returns how many it did.
+
+const double thread_run_seconds = 0.5;
+
+struct ThreadTest {
+    bool stop;
+
+    ThreadTest() : stop(false) {}
+    bool stopped() const { return __atomic_load_n(&stop, __ATOMIC_RELAXED); }
+};
+
+template <class Test>
+struct ThreadStart {
+    Test *test;
+    int index;
+    size_t ops;
+
+    static void *start(void *p) {
+        ThreadStart *t = static_cast<ThreadStart *>(p);
+        t->ops = t->test->run_thread(t->index);
+        return NULL;
+    }
+};
+
+// Run a thread test on nthreads threads for thread_run_seconds. Store the
+// number of operations each thread did in ops. Return the elapsed time in
+// seconds.
+template <class Test>
+double measure_threads(Test &test, int nthreads, vector<size_t> &ops)
+{
+    vector<pthread_t> threads(nthreads);
+    vector<ThreadStart<Test> > starts(nthreads);
+
+    Stopwatch watch;
+    watch.start();
+    for (int i = 0; i < nthreads; i++) {
+        starts[i].test = &test;
+        starts[i].index = i;
+        if (pthread_create(&threads[i], NULL, ThreadStart<Test>::start, &starts[i]) != 0)
+            abort();
+    }
+    usleep(useconds_t(thread_run_seconds * 1e6));
+    __atomic_store_n(&test.stop, true, __ATOMIC_RELAXED);
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    double dt = watch.elapsed();
+
+    ops.resize(nthreads);
+    for (int i = 0; i < nthreads; i++)
+        ops[i] = starts[i].ops;
+    return dt;
+}
+
+// A CloseTable behind a mutex: what ConcurrentCloseTable is meant to beat.
+class MutexCloseTable {
+    CloseTable table;
+    pthread_mutex_t mutex;
+
+public:
+    MutexCloseTable() { pthread_mutex_init(&mutex, NULL); }
+    ~MutexCloseTable() { pthread_mutex_destroy(&mutex); }
+
+    void set(KeyArg key, ValueArg value) {
+        pthread_mutex_lock(&mutex);
+        table.set(key, value);
+        pthread_mutex_unlock(&mutex);
+    }
+
+    bool remove(KeyArg key) {
+        pthread_mutex_lock(&mutex);
+        bool removed = table.remove(key);
+        pthread_mutex_unlock(&mutex);
+        return removed;
+    }
+
+    class Reader {
+        MutexCloseTable &t;
+
+    public:
+        explicit Reader(MutexCloseTable &t) : t(t) {}
+
+        Value get(KeyArg key) {
+            pthread_mutex_lock(&t.mutex);
+            Value v = t.table.get(key);
+            pthread_mutex_unlock(&t.mutex);
+            return v;
+        }
+    };
+};
+
+// Thread 0 adds and removes entries in FIFO order, as in WorklistTest; the
+// rest look up keys. Roughly half the lookups hit. Only lookups are counted.
+template <class Table>
+struct ReaderScalingTest : ThreadTest {
+    enum { Size = 100000 };
+    Table table;
+    Key w;
+
+    ReaderScalingTest() {
+        w = 1;
+        for (int i = 0; i < Size; i++) {
+            table.set(w, w);
+            w = w * 1103515245 + 12345;
+        }
+    }
+
+    size_t run_thread(int i) {
+        size_t ops = 0;
+        if (i == 0) {
+            Key r = 1;
+            while (!stopped()) {
+                table.set(w, w);
+                w = w * 1103515245 + 12345;
+                table.remove(r);
+                r = r * 1103515245 + 12345;
+            }
+            return 0;
+        }
+
+        typename Table::Reader reader(table);
+        Value sum = 0;
+        Key k = 1;
+        while (!stopped()) {
+            for (int j = 0; j < 2 * Size; j++) {
+                sum += reader.get(k);
+                k = k * 1103515245 + 12345;
+            }
+            ops += 2 * Size;
+            k = 1;
+        }
+        sink = sum;
+        return ops;
+    }
+
+    static volatile Value sink;
+};
+
+template <class Table>
+volatile Value ReaderScalingTest<Table>::sink;
+
+// Run a ReaderScalingTest with 1 to max_readers reader threads. For each, print
+// [readers, lookups, seconds].
+template <class Table>
+void run_reader_trials(int max_readers)
+{
+    cout << "[\n";
+    for (int readers = 1; readers <= max_readers; readers++) {
+        ReaderScalingTest<Table> *test = new ReaderScalingTest<Table>;
+        vector<size_t> ops;
+        double dt = measure_threads(*test, readers + 1, ops);
+        size_t lookups = 0;
+        for (int i = 1; i <= readers; i++)
+            lookups += ops[i];
+        delete test;
+        cout << "\t\t[" << readers << ", " << lookups << ", " << dt
+             << (readers < max_readers ? "]," : "]") << endl;
+    }
+    cout << "\t]";
+}
+
+void run_reader_scaling(int max_readers)
+{
+    cout << '{' << endl;
+
+    cout << "\t\"MutexCloseTable\": ";
+    run_reader_trials<MutexCloseTable>(max_readers);
+    cout << ',' << endl;
+
+    cout << "\t\"ConcurrentCloseTable\": ";
+    run_reader_trials<ConcurrentCloseTable>(max_readers);
+    cout << endl;
+
+    cout << '}' << endl;
+}
+
+// Every thread does a mix of 80% get, 10% set and 10% remove, on keys drawn
+// uniformly from 1..KeySpace. The table starts out half full.
+template <class Table>
+struct MixedThreadTest : ThreadTest {
+    enum { KeySpace = 1 << 20 };
+    Table table;
+
+    MixedThreadTest() {
+        for (Key k = 1; k <= KeySpace; k += 2)
+            table.set(k, k);
+    }
+
+    size_t run_thread(int i) {
+        uint64_t x = i + 1;
+        size_t ops = 0;
+        Value sum = 0;
+        while (!stopped()) {
+            for (int j = 0; j < 1000; j++) {
+                x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+                Key k = (x >> 33) % KeySpace + 1;
+                unsigned op = unsigned(x >> 24) % 10;
+                if (op == 0)
+                    table.set(k, k);
+                else if (op == 1)
+                    table.remove(k);
+                else
+                    sum += table.get(k);
+            }
+            ops += 1000;
+        }
+        sink = sum;
+        return ops;
+    }
+
+    static volatile Value sink;
+};
+
+template <class Table>
+volatile Value MixedThreadTest<Table>::sink;
+
+// Run a MixedThreadTest on 1 to max_threads threads. For each, print
+// [threads, operations, seconds].
+template <class Table>
+void run_mixed_thread_trials(int max_threads)
+{
+    cout << "[\n";
+    for (int threads = 1; threads <= max_threads; threads++) {
+        MixedThreadTest<Table> *test = new MixedThreadTest<Table>;
+        vector<size_t> ops;
+        double dt = measure_threads(*test, threads, ops);
+        size_t total = 0;
+        for (int i = 0; i < threads; i++)
+            total += ops[i];
+        delete test;
+        cout << "\t\t[" << threads << ", " << total << ", " << dt
+             << (threads < max_threads ? "]," : "]") << endl;
+    }
+    cout << "\t]";
+}
+
+void run_thread_scaling(int max_threads)
+{
+    cout << '{' << endl;
+
+    cout << "\t\"LockedCloseTable\": ";
+    run_mixed_thread_trials<ShardedTable<CloseTable, 0> >(max_threads);
+    cout << ',' << endl;
+
+    cout << "\t\"ShardedOpenTable\": ";
+    run_mixed_thread_trials<ShardedTable<OpenTable> >(max_threads);
+    cout << ',' << endl;
+
+    cout << "\t\"ShardedCloseTable\": ";
+    run_mixed_thread_trials<ShardedTable<CloseTable> >(max_threads);
+    cout << endl;
+
+    cout << '}' << endl;
+}
+
+// === Rehashing very large tables
+//
+// hashbench --huge [n] runs InsertLargeTest with n keys (default 10^8) for
+// OpenTable and CloseTable, first with every rehash on one thread and then
+// with big rehashes spread over every CPU (see ParallelRehash in tables.h).
+// Each point is [n, seconds, allocations, bytes allocated]. At the default
+// size, each table takes several gigabytes.
+
+const int huge_trials = 3;
+
+template <class Table>
+void run_huge_trials(size_t n, unsigned threads)
+{
+    unsigned saved = ParallelRehash::threads;
+    ParallelRehash::threads = threads;
+    cout << "[\n";
+    for (int i = 0; i < huge_trials; i++) {
+        RunStats stats;
+        double dt = measure_single_run<InsertLargeTest<Table> >(n, &stats);
+        cout << "\t\t[" << n << ", " << dt << ", " << stats.allocs.allocations << ", " << stats.allocs.bytes
+             << (i < huge_trials - 1 ? "]," : "]") << endl;
     }
+    cout << "\t]";
+    ParallelRehash::threads = saved;
+}
+
+void run_huge_insert_test(size_t n)
+{
+    cout << '{' << endl;
+
+    cout << "\t\"OpenTable\": ";
+    run_huge_trials<OpenTable>(n, 1);
+    cout << ',' << endl;
+
+    cout << "\t\"OpenTable/parallel\": ";
+    run_huge_trials<OpenTable>(n, 0);
+    cout << ',' << endl;
+
+    cout << "\t\"CloseTable\": ";
+    run_huge_trials<CloseTable>(n, 1);
+    cout << ',' << endl;
+
+    cout << "\t\"CloseTable/parallel\": ";
+    run_huge_trials<CloseTable>(n, 0);
+    cout << endl;
+
+    cout << '}' << endl;
 }
 
+#endif  // HAVE_PTHREADS
+
 int main(int argc, const char **argv) {
+#ifdef HAVE_PERF_EVENTS
+    if (argc >= 2 && argc <= 3 && strcmp(argv[1], "-c") == 0) {
+        count_events = true;
+        pin_to_current_cpu();
+        argv[1] = argv[0];
+        argc--;
+        argv++;
+    }
+#endif
+#ifdef TABLE_STATS
+    if (argc >= 2 && argc <= 3 && strcmp(argv[1], "-s") == 0) {
+        dump_stats = true;
+        argv[1] = argv[0];
+        argc--;
+        argv++;
+    }
+#endif
+
     if (argc == 2 && (strcmp(argv[1], "-m") == 0 || strcmp(argv[1], "-w") == 0)) {
         measure_space(argv[1][1] == 'm' ? BytesAllocated : BytesWritten);
+    } else if (argc >= 2 && strcmp(argv[1], "-x") == 0 && run_mixed_test(argc - 2, argv + 2)) {
+        // done
+    } else if ((argc == 2 || argc == 3) && strcmp(argv[1], "--snapshots") == 0) {
+        int max_snapshots = argc == 3 ? atoi(argv[2]) : 16;
+        run_snapshot_memory_test(max_snapshots < 1 ? 1 : max_snapshots);
+#ifdef HAVE_MMAP
+    } else if (argc == 3 && strcmp(argv[1], "--replay") == 0) {
+        run_replay(argv[2]);
+    } else if ((argc == 2 || argc == 3) && strcmp(argv[1], "-f") == 0) {
+        long n = argc == 3 ? atol(argv[2]) : 4000000;
+        run_startup_test(n < 1 ? 1 : size_t(n));
+    } else if ((argc == 2 || argc == 3) && strcmp(argv[1], "--large") == 0) {
+        double n = argc == 3 ? atof(argv[2]) : 5e9;
+        run_large_test(n < 1 ? 1 : size_t(n));
+#endif
+#ifdef HAVE_CLOCK_GETTIME
+    } else if ((argc == 2 || argc == 3) && strcmp(argv[1], "-l") == 0) {
+        run_latency_tests(argc == 3 ? argv[2] : NULL);
+#endif
+#ifdef HAVE_PTHREADS
+    } else if ((argc == 2 || argc == 3) && strcmp(argv[1], "-r") == 0) {
+        int max_readers = argc == 3 ? atoi(argv[2]) : int(sysconf(_SC_NPROCESSORS_ONLN));
+        run_reader_scaling(max_readers < 1 ? 1 : max_readers);
+    } else if ((argc == 2 || argc == 3) && strcmp(argv[1], "-p") == 0) {
+        int max_threads = argc == 3 ? atoi(argv[2]) : int(sysconf(_SC_NPROCESSORS_ONLN));
+        run_thread_scaling(max_threads < 1 ? 1 : max_threads);
+    } else if ((argc == 2 || argc == 3) && strcmp(argv[1], "--huge") == 0) {
+        long n = argc == 3 ? atol(argv[2]) : 100000000;
+        run_huge_insert_test(n < 1 ? 1 : size_t(n));
+#endif
     } else if (argc == 1) {
         //cout << measure_single_run<LookupHitTest<OpenTable> >(1000000) << endl;
         run_all_speed_tests();
@@ -385,6 +2652,33 @@ int main(int argc, const char **argv) {
         run_one_speed_test(argv[1]);
     } else {
         cerr << "usage:\n  " << argv[0] << "\n  " << argv[0] << " -m\n  " << argv[0] << " -w\n";
+        cerr << "  " << argv[0] << " -x [name=value ...]\n"
+             << "      read=90 insert=5 update=0 delete=5   relative weights of each op\n"
+             << "      dist=zipf|uniform|hotspot|sequential\n"
+             << "      theta=0.99                         Zipf skew\n"
+             << "      hot=0.2 hotops=0.8                 hotspot: 80% of ops on 20% of keys\n"
+             << "      size=100000                        table size\n"
+             << "      hit=1                              fraction of reads that hit\n";
+        cerr << "  " << argv[0] << " --snapshots [max_snapshots]\n";
+#ifdef HAVE_PERF_EVENTS
+        cerr << "  " << argv[0] << " -c [TestName]\n";
+#endif
+#ifdef TABLE_STATS
+        cerr << "  " << argv[0] << " -s [TestName]\n";
+#endif
+#ifdef HAVE_CLOCK_GETTIME
+        cerr << "  " << argv[0] << " -l [TestName]\n";
+#endif
+#ifdef HAVE_MMAP
+        cerr << "  " << argv[0] << " --replay trace-file\n";
+        cerr << "  " << argv[0] << " -f [n]\n";
+        cerr << "  " << argv[0] << " --large [n]\n";
+#endif
+#ifdef HAVE_PTHREADS
+        cerr << "  " << argv[0] << " -r [max_readers]\n";
+        cerr << "  " << argv[0] << " -p [max_threads]\n";
+        cerr << "  " << argv[0] << " --huge [n]\n";
+#endif
         return 1;
     }
 
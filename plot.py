@@ -3,6 +3,22 @@ import sys
 from matplotlib.pyplot import *
 import numpy
 
+columns = [
+    ('-', dict(color='#cccccc', label='dense_hash_map (open addressing)')),
+    ('b-', dict(label='open addressing')),
+    ('r-', dict(label='Close table')),
+    ('g-', dict(label='Close table, Swiss index')),
+    ('m-', dict(label='Close table, incremental rehash')),
+    ('c-', dict(label='Close table, 32-bit index chains')),
+    ('y-', dict(label='Robin Hood (open addressing)')),
+    ('b--', dict(label='open addressing, 8 entries inline')),
+    ('r--', dict(label='Close table, 8 entries inline')),
+    ('k-', dict(label='Close table, 64-byte buckets')),
+    ('b:', dict(label='open addressing set (keys only)')),
+    ('r:', dict(label='Close table set (keys only)')),
+    ('r-.', dict(label='Close table, peak during rehash')),
+]
+
 def main(filename, outfilename):
     data = numpy.genfromtxt(filename)
 
@@ -15,20 +31,19 @@ def main(filename, outfilename):
         ylabel('bytes of memory written')
     xlabel('number of entries')
 
+    # One column per table, in the order hashbench's measure_space prints them.
+    # figure-1 has one more, CloseTable's peak.
     index = data[:,0]
-    series1 = data[:,1]
-    series2 = data[:,2]
-    series3 = data[:,3]
-    loglog(index, series1, '-', color='#cccccc', label='dense_hash_map (open addressing)')
-    loglog(index, series2, 'b-', label='open addressing')
-    loglog(index, series3, 'r-', label='Close table')
+    for column, (style, kwargs) in enumerate(columns[:data.shape[1] - 1], 1):
+        loglog(index, data[:,column], style, **kwargs)
     legend(loc='upper left')
     savefig(outfilename, format='png')
 
     # compute and print summary information about which is bigger
     r1 = []
     r2 = []
-    for i, _, s1, s2 in data:
+    for row in data:
+        s1, s2 = row[2], row[3]
         if s1 > s2:
             r1.append(s1/s2)
         else:
@@ -0,0 +1,50 @@
+from __future__ import division
+import sys
+import matplotlib.pyplot as plt
+import json
+from plot_speed import implementations
+
+# Plot the output of `hashbench -l`: for each test, the fraction of
+# operations slower than each latency, for each implementation. Both axes are
+# logarithmic, so the rare slow operations (rehashes) are visible at the
+# bottom right instead of being squashed against 1.0.
+
+def main(filename):
+    with open(filename) as f:
+        data = json.load(f)
+    if 'OpenTable' in data:
+        # Output of `hashbench -l TestName`. Name it after the file.
+        data = {filename.rsplit('.', 1)[0]: data}
+
+    for testname, results in data.items():
+        fig = plt.figure()
+        fig.suptitle(testname)
+        axes = fig.gca()
+        axes.set_xscale('log')
+        axes.set_yscale('log')
+        axes.set_xlabel('latency (ns)')
+        axes.set_ylabel('fraction of operations slower')
+
+        def show(result, *args, **kwargs):
+            xs = [x for x, y in result['cdf']]
+            ys = [max(1 - y, 0.5 / result['count']) for x, y in result['cdf']]
+            axes.step(xs, ys, *args, where='post', **kwargs)
+
+        known = set(name for name, _, _ in implementations)
+        for name, style, kwargs in implementations:
+            if name in results:
+                show(results[name], style.rstrip('o'), **kwargs)
+        for name in sorted(results):
+            if name not in known:
+                show(results[name], '-', label=name)
+        axes.legend(loc='best')
+        fig.savefig(testname + "-latency.png", format='png')
+
+        print(testname)
+        for name in sorted(results):
+            r = results[name]
+            print('  %-24s p50 %8d  p99 %8d  p99.9 %8d  max %10d ns'
+                  % (name, r['p50'], r['p99'], r['p99.9'], r['max']))
+
+if __name__ == '__main__':
+    main(sys.argv[1])
@@ -4,6 +4,21 @@ import matplotlib.pyplot as plt
 import numpy
 import json
 
+implementations = [
+    ('DenseTable', '-o', dict(color='#cccccc', label='dense_hash_map (open addressing)')),
+    ('OpenTable', 'b-o', dict(label='open addressing')),
+    ('RobinHoodTable', 'y-o', dict(label='Robin Hood (open addressing)')),
+    ('CloseTable', 'r-o', dict(label='Close table')),
+    ('IncrementalCloseTable', 'm-o', dict(label='Close table, incremental rehash')),
+    ('SwissCloseTable', 'g-o', dict(label='Close table, Swiss index')),
+    ('CompactCloseTable', 'c-o', dict(label='Close table, 32-bit index chains')),
+    ('InlineOpenTable', 'b--o', dict(label='open addressing, 8 entries inline')),
+    ('InlineCloseTable', 'r--o', dict(label='Close table, 8 entries inline')),
+    ('BucketCloseTable', 'k-o', dict(label='Close table, 64-byte buckets')),
+    ('OpenSet', 'b:o', dict(label='open addressing set (keys only)')),
+    ('CloseSet', 'r:o', dict(label='Close table set (keys only)')),
+]
+
 def main(filename):
     with open(filename) as f:
         data = json.load(f)
@@ -14,20 +29,25 @@ def main(filename):
         fig.suptitle(testname)
         axes = fig.gca()
         axes.set_ylabel('speed (operations/second)')
-        hi = max(max(x/y for x, y in series) for series in results.values())
+        # Each point is [n, seconds, allocations, bytes allocated].
+        hi = max(max(p[0]/p[1] for p in series) for series in results.values())
         axes.set_ylim(bottom=0, top=hi * 1.2)
         axes.set_xlabel('number of operations')
 
         def show(data, *args, **kwargs):
-            xs = [x for x, y in data]
-            ys = [x/y for x, y in data]
+            xs = [p[0] for p in data]
+            ys = [p[0]/p[1] for p in data]
             axes.plot(xs, ys, *args, **kwargs)
 
-        if 'DenseTable' in results:
-            show(results['DenseTable'], '-o', color='#cccccc', label='dense_hash_map (open addressing)')
-        show(results['OpenTable'], 'b-o', label='open addressing')
-        show(results['CloseTable'], 'r-o', label='Close table')
+        for name, style, kwargs in implementations:
+            if name in results:
+                show(results[name], style, **kwargs)
+        known = set(name for name, _, _ in implementations)
+        for name in sorted(results):
+            if name not in known:
+                show(results[name], '-o', label=name)
         axes.legend(loc='best')
         fig.savefig(testname + "-speed.png", format='png')
 
-main(sys.argv[1])
+if __name__ == '__main__':
+    main(sys.argv[1])
@@ -1,309 +1,3796 @@
 #include "tables.h"
 #include <cstring>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define USE_SSE2
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#ifdef HAVE_PTHREADS
+#include <unistd.h>
+#endif
+#ifdef HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef TABLE_STATS
+#if defined(HAVE_CLOCK_GETTIME)
+#include <time.h>
+#elif defined(HAVE_GETTIMEOFDAY)
+#include <sys/time.h>
+#else
+#include <ctime>
+#endif
+#endif
 
 using namespace std;
 
+uint64_t MixHash::seed = 0x2545F4914F6CDD1DULL;
+
+// Hint that the cache line containing p is about to be read.
+static inline void
+prefetch(const void *p)
+{
+#if defined(__GNUC__)
+    __builtin_prefetch(p);
+#elif defined(USE_SSE2)
+    _mm_prefetch(static_cast<const char *>(p), _MM_HINT_T0);
+#else
+    (void) p;
+#endif
+}
+
+#ifdef TABLE_STATS
+// A clock for timing rehashes, in seconds from some arbitrary starting point.
+static double
+stats_clock()
+{
+#if defined(HAVE_CLOCK_GETTIME)
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + 1e-9 * t.tv_nsec;
+#elif defined(HAVE_GETTIMEOFDAY)
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    return t.tv_sec + 1e-6 * t.tv_usec;
+#else
+    return double(std::clock()) / CLOCKS_PER_SEC;
+#endif
+}
+
+// Counts and times one rehash, from construction to destruction, so that
+// every way out of a rehash function is counted.
+class RehashTimer {
+    TableCounters &counters;
+    size_t old_buckets, new_buckets;
+    double start;
+
+public:
+    RehashTimer(TableCounters &c, size_t old_n, size_t new_n)
+      : counters(c), old_buckets(old_n), new_buckets(new_n), start(stats_clock()) {}
+    ~RehashTimer() { counters.count_rehash(old_buckets, new_buckets, stats_clock() - start); }
+};
+#endif
+
+
+// === Allocators
+
+// Allocate an array of n default-initialized T's from Alloc, like new T[n].
+template <class T, class Alloc>
+static T *
+new_array(size_t n)
+{
+    T *p = static_cast<T *>(Alloc::allocate(n * sizeof(T)));
+    for (size_t i = 0; i < n; i++)
+        new (&p[i]) T;
+    return p;
+}
+
+// Destroy an array made by new_array<T, Alloc>(n) and give it back.
+template <class Alloc, class T>
+static void
+delete_array(T *p, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        p[i].~T();
+    Alloc::deallocate(p, n * sizeof(T));
+}
+
+// Resize an array made by new_array<T, Alloc>(old_n) to new_n elements using
+// Alloc::reallocate, destroying or default-initializing the elements at the
+// end. Only for allocators where Alloc::can_reallocate says yes.
+template <class T, class Alloc>
+static T *
+resize_array(T *p, size_t old_n, size_t new_n)
+{
+    for (size_t i = new_n; i < old_n; i++)
+        p[i].~T();
+    p = static_cast<T *>(Alloc::reallocate(p, old_n * sizeof(T), new_n * sizeof(T)));
+    for (size_t i = old_n; i < new_n; i++)
+        new (&p[i]) T;
+    return p;
+}
+
+// Allocate an array of n T's from Alloc, copied from src[0..n).
+template <class T, class Alloc>
+static T *
+copy_array(const T *src, size_t n)
+{
+    T *p = static_cast<T *>(Alloc::allocate(n * sizeof(T)));
+    for (size_t i = 0; i < n; i++)
+        new (&p[i]) T(src[i]);
+    return p;
+}
+
+namespace {
+
+// One thread's free lists. lists[c] holds blocks of 2^c bytes.
+struct Pool {
+    struct Block { Block *next; };
+
+    Block *lists[PoolAllocator::MaxClassBits + 1];
+    size_t counts[PoolAllocator::MaxClassBits + 1];
+
+    Pool() {
+        memset(lists, 0, sizeof(lists));
+        memset(counts, 0, sizeof(counts));
+    }
+
+    ~Pool() {
+        for (int c = 0; c <= PoolAllocator::MaxClassBits; c++) {
+            while (Block *b = lists[c]) {
+                lists[c] = b->next;
+                ::operator delete(b);
+            }
+        }
+    }
+};
+
+#ifdef HAVE_PTHREADS
+pthread_key_t pool_key;
+pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+
+extern "C" void
+destroy_pool(void *pool)
+{
+    delete static_cast<Pool *>(pool);
+}
+
+extern "C" void
+create_pool_key()
+{
+    if (pthread_key_create(&pool_key, destroy_pool) != 0)
+        abort();
+}
+
+Pool *
+this_thread_pool()
+{
+    pthread_once(&pool_key_once, create_pool_key);
+    Pool *pool = static_cast<Pool *>(pthread_getspecific(pool_key));
+    if (!pool) {
+        pool = new Pool;
+        pthread_setspecific(pool_key, pool);
+    }
+    return pool;
+}
+#else
+Pool *
+this_thread_pool()
+{
+    static Pool *pool = new Pool;
+    return pool;
+}
+#endif
+
+// The size class for a block of nbytes, or -1 if it's too big to pool.
+inline int
+size_class(size_t nbytes)
+{
+    int c = PoolAllocator::MinClassBits;
+    while ((size_t(1) << c) < nbytes) {
+        if (++c > PoolAllocator::MaxClassBits)
+            return -1;
+    }
+    return c;
+}
+
+}  // namespace
+
+void *
+PoolAllocator::allocate(size_t nbytes)
+{
+    int c = size_class(nbytes);
+    if (c < 0)
+        return ::operator new(nbytes);
+    Pool *pool = this_thread_pool();
+    Pool::Block *b = pool->lists[c];
+    if (!b)
+        return ::operator new(size_t(1) << c);
+    pool->lists[c] = b->next;
+    pool->counts[c]--;
+    return b;
+}
+
+void
+PoolAllocator::deallocate(void *p, size_t nbytes)
+{
+    int c = size_class(nbytes);
+    Pool *pool = c < 0 ? NULL : this_thread_pool();
+    if (!pool || pool->counts[c] == MaxCachedBlocks) {
+        ::operator delete(p);
+        return;
+    }
+    Pool::Block *b = static_cast<Pool::Block *>(p);
+    b->next = pool->lists[c];
+    pool->lists[c] = b;
+    pool->counts[c]++;
+}
+
+Arena *Arena::current_arena = NULL;
+
+Arena::Arena()
+{
+    chunks = current_chunk = large = NULL;
+    next = limit = NULL;
+}
+
+Arena::~Arena()
+{
+    release();
+    while (Chunk *c = chunks) {
+        chunks = c->next;
+        ::operator delete(c);
+    }
+}
+
+void
+Arena::start_chunk(Chunk *c)
+{
+    current_chunk = c;
+    next = chunk_start(c);
+    limit = next + c->size;
+}
+
+void *
+Arena::allocate(size_t nbytes)
+{
+    nbytes = (nbytes + Align - 1) & ~size_t(Align - 1);
+
+    // Big blocks get a chunk of their own, so as not to waste the rest of
+    // the current one.
+    if (nbytes > ChunkBytes / 4) {
+        Chunk *c = static_cast<Chunk *>(::operator new(Align + nbytes));
+        c->size = nbytes;
+        c->next = large;
+        large = c;
+        return chunk_start(c);
+    }
+
+    if (size_t(limit - next) < nbytes) {
+        // Move on to the next chunk, reusing one kept by release() if any.
+        Chunk *c = current_chunk ? current_chunk->next : chunks;
+        if (!c) {
+            c = static_cast<Chunk *>(::operator new(Align + ChunkBytes));
+            c->size = ChunkBytes;
+            c->next = NULL;
+            if (current_chunk)
+                current_chunk->next = c;
+            else
+                chunks = c;
+        }
+        start_chunk(c);
+    }
+    void *p = next;
+    next += nbytes;
+    return p;
+}
+
+void
+Arena::release()
+{
+    while (Chunk *c = large) {
+        large = c->next;
+        ::operator delete(c);
+    }
+    if (chunks)
+        start_chunk(chunks);
+}
+
+#ifdef HAVE_MMAP
+// Huge blocks are mapped in whole multiples of HugeBytes, so that
+// deallocate can work out the length of the mapping from nbytes.
+static size_t
+huge_length(size_t nbytes)
+{
+    size_t huge = HugePageAllocator::HugeBytes;
+    return (nbytes + huge - 1) & ~(huge - 1);
+}
+
+void *
+HugePageAllocator::allocate(size_t nbytes)
+{
+    if (nbytes < size_t(HugeBytes))
+        return ::operator new(nbytes);
+
+    // Map an extra HugeBytes, then trim both ends so that what is left
+    // starts on a huge page boundary.
+    size_t length = huge_length(nbytes);
+    size_t padded = length + HugeBytes;
+    void *m = mmap(NULL, padded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m == MAP_FAILED)
+        throw std::bad_alloc();
+    char *start = static_cast<char *>(m);
+    uintptr_t a = reinterpret_cast<uintptr_t>(start);
+    char *p = reinterpret_cast<char *>((a + HugeBytes - 1) & ~uintptr_t(HugeBytes - 1));
+    if (p != start)
+        munmap(start, p - start);
+    if (start + padded != p + length)
+        munmap(p + length, start + padded - (p + length));
+#ifdef MADV_HUGEPAGE
+    madvise(p, length, MADV_HUGEPAGE);
+#endif
+    return p;
+}
+
+void
+HugePageAllocator::deallocate(void *p, size_t nbytes)
+{
+    if (nbytes < size_t(HugeBytes))
+        ::operator delete(p);
+    else
+        munmap(p, huge_length(nbytes));
+}
+
+bool
+HugePageAllocator::can_reallocate(size_t old_nbytes, size_t new_nbytes)
+{
+#ifdef MREMAP_MAYMOVE
+    return old_nbytes >= size_t(HugeBytes) && new_nbytes >= size_t(HugeBytes);
+#else
+    (void) old_nbytes;
+    (void) new_nbytes;
+    return false;
+#endif
+}
+
+void *
+HugePageAllocator::reallocate(void *p, size_t old_nbytes, size_t new_nbytes)
+{
+#ifdef MREMAP_MAYMOVE
+    size_t old_length = huge_length(old_nbytes), new_length = huge_length(new_nbytes);
+    if (new_length == old_length)
+        return p;
+
+    // Shrink, or grow into the pages right after the mapping if they are
+    // free. Either way the block stays where it is, so it stays aligned.
+    void *q = mremap(p, old_length, new_length, 0);
+    if (q == MAP_FAILED) {
+        // Move it. Left to itself, mremap could move it anywhere, breaking the
+        // huge page alignment allocate set up; so map an aligned range first
+        // and move the block on top of it.
+        void *target = allocate(new_nbytes);
+#ifdef MREMAP_FIXED
+        q = mremap(p, old_length, new_length, MREMAP_MAYMOVE | MREMAP_FIXED, target);
+        if (q == MAP_FAILED) {
+            deallocate(target, new_nbytes);
+            throw std::bad_alloc();
+        }
+#else
+        memcpy(target, p, old_nbytes);
+        deallocate(p, old_nbytes);
+        q = target;
+#endif
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(q, new_length, MADV_HUGEPAGE);
+#endif
+    return q;
+#else
+    (void) p;
+    (void) old_nbytes;
+    (void) new_nbytes;
+    abort();
+#endif
+}
+#endif
+
+
+#ifdef HAVE_PTHREADS
+// === Parallel rehash
+
+size_t ParallelRehash::threshold = size_t(1) << 22;
+unsigned ParallelRehash::threads = 0;
+
+namespace {
+
+// The number of threads to rehash a table of n entries on.
+unsigned
+rehash_threads(size_t n)
+{
+    if (n < ParallelRehash::threshold)
+        return 1;
+    unsigned threads = ParallelRehash::threads;
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus < 1 ? 1 : unsigned(cpus);
+    }
+    return threads;
+}
+
+// The ith of n nearly equal parts of [0, length) is [part(length, n, i),
+// part(length, n, i + 1)).
+inline size_t
+part(size_t length, unsigned n, unsigned i)
+{
+    return size_t(double(length) * i / n);
+}
+
+template <class Job>
+struct ParallelTask {
+    Job *job;
+    unsigned index;
+
+    static void *start(void *p) {
+        ParallelTask *task = static_cast<ParallelTask *>(p);
+        task->job->run(task->index);
+        return NULL;
+    }
+};
+
+// Call job.run(i) for each i in [0, n), each on a thread of its own
+// (job.run(0) on this one), and wait for them all. If a thread can't be
+// started, its part runs on this thread afterward.
+template <class Job>
+void
+run_parallel(Job &job, unsigned n)
+{
+    vector<ParallelTask<Job> > tasks(n);
+    vector<pthread_t> threads(n);
+    vector<char> started(n, 0);
+    for (unsigned i = 1; i < n; i++) {
+        tasks[i].job = &job;
+        tasks[i].index = i;
+        started[i] = pthread_create(&threads[i], NULL, ParallelTask<Job>::start, &tasks[i]) == 0;
+    }
+    job.run(0);
+    for (unsigned i = 1; i < n; i++) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        else
+            job.run(i);
+    }
+}
+
+// Claiming an empty OpenTable slot for a key, for rehashing in parallel.
+// Only 64-bit integer keys support it; for other keys, claim() is never
+// called.
+template <class K>
+struct AtomicKey {
+    enum { Supported = 0 };
+    static bool claim(K &, const K &, const K &) { abort(); }
+};
+
+template <>
+struct AtomicKey<uint64_t> {
+    enum { Supported = 1 };
+
+    // Store key in slot if slot still holds empty.
+    static bool claim(uint64_t &slot, uint64_t empty, uint64_t key) {
+        return __atomic_compare_exchange_n(&slot, &empty, key, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+};
+
+}  // namespace
+#endif  // HAVE_PTHREADS
+
 
 // === OpenTable
 
-OpenTable::OpenTable() {
-    table = new Entry[8];
-    mask = 7;
-    live_count = 0;
-    nonempty_count = 0;
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+BasicOpenTable<K, V, HashPolicy, Traits, Alloc>::BasicOpenTable() {
+    table = new_array<Entry, Alloc>(8);
+    mask = 7;
+    live_count = 0;
+    nonempty_count = 0;
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+BasicOpenTable<K, V, HashPolicy, Traits, Alloc>::BasicOpenTable(const BasicOpenTable &other)
+{
+    table = copy_array<Entry, Alloc>(other.table, other.mask + 1);
+    mask = other.mask;
+    live_count = other.live_count;
+    nonempty_count = other.nonempty_count;
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+BasicOpenTable<K, V, HashPolicy, Traits, Alloc> &
+BasicOpenTable<K, V, HashPolicy, Traits, Alloc>::operator=(const BasicOpenTable &other)
+{
+    if (this != &other) {
+        Entry *new_table = copy_array<Entry, Alloc>(other.table, other.mask + 1);
+        delete_array<Alloc>(table, mask + 1);
+        table = new_table;
+        mask = other.mask;
+        live_count = other.live_count;
+        nonempty_count = other.nonempty_count;
+    }
+    return *this;
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+BasicOpenTable<K, V, HashPolicy, Traits, Alloc>::~BasicOpenTable() {
+    delete_array<Alloc>(table, mask + 1);
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+typename BasicOpenTable<K, V, HashPolicy, Traits, Alloc>::Entry *
+BasicOpenTable<K, V, HashPolicy, Traits, Alloc>::lookup(KeyArg key, hashcode_t h)
+{
+    size_t i = h & mask;
+    h >>= 3;
+    while (!Traits::isEmpty(table[i].key)) {
+        if (Traits::equal(table[i].key, key))
+            return &table[i];
+        i = (i + (h | 1)) & mask;
+    }
+    return NULL;
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+const typename BasicOpenTable<K, V, HashPolicy, Traits, Alloc>::Entry *
+BasicOpenTable<K, V, HashPolicy, Traits, Alloc>::lookup(KeyArg key) const
+{
+#ifdef TABLE_STATS
+    return counted_lookup(key, hash_key(key));
+#else
+    return const_cast<BasicOpenTable *>(this)->lookup(key, hash_key(key));
+#endif
+}
+
+#ifdef TABLE_STATS
+// lookup(key, h), counting probes. The lookups for get, has, get_many and
+// has_many come here.
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+const typename BasicOpenTable<K, V, HashPolicy, Traits, Alloc>::Entry *
+BasicOpenTable<K, V, HashPolicy, Traits, Alloc>::counted_lookup(KeyArg key, hashcode_t h) const
+{
+    size_t i = h & mask;
+    size_t probes = 1;
+    h >>= 3;
+    while (!Traits::isEmpty(table[i].key)) {
+        if (Traits::equal(table[i].key, key)) {
+            counters.count_lookup(true, probes);
+            return &table[i];
+        }
+        i = (i + (h | 1)) & mask;
+        probes++;
+    }
+    counters.count_lookup(false, probes);
+    return NULL;
+}
+#endif
+
+// Look up keys[0..n), n <= BatchSize, storing the entries found (or NULL) in
+// found[0..n).
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+void
+BasicOpenTable<K, V, HashPolicy, Traits, Alloc>::lookup_batch(const Key *keys, size_t n, const Entry **found) const
+{
+    hashcode_t hs[BatchSize];
+    for (size_t j = 0; j < n; j++) {
+        hs[j] = hash_key(keys[j]);
+        prefetch(&table[hs[j] & mask]);
+    }
+    for (size_t j = 0; j < n; j++) {
+#ifdef TABLE_STATS
+        found[j] = counted_lookup(keys[j], hs[j]);
+#else
+        found[j] = const_cast<BasicOpenTable *>(this)->lookup(keys[j], hs[j]);
+#endif
+    }
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+void
+BasicOpenTable<K, V, HashPolicy, Traits, Alloc>::rehash(size_t new_capacity)
+{
+#ifdef TABLE_STATS
+    RehashTimer timer(counters, mask + 1, new_capacity);
+#endif
+#ifdef HAVE_PTHREADS
+    unsigned threads = AtomicKey<Key>::Supported ? rehash_threads(live_count) : 1;
+    if (threads > 1) {
+        RehashJob job(*this, new_capacity, threads);
+        run_parallel(job, threads);
+        job.phase = RehashJob::Insert;
+        run_parallel(job, threads);
+        delete_array<Alloc>(table, mask + 1);
+        table = job.new_table;
+        mask = new_capacity - 1;
+        nonempty_count = live_count;
+        return;
+    }
+#endif
+
+    Entry *old_table = table;
+    Entry *old_table_end = table + mask + 1;
+    table = new_array<Entry, Alloc>(new_capacity);
+    mask = new_capacity - 1;
+    live_count = 0;
+    nonempty_count = 0;
+    for (Entry *p = old_table; p != old_table_end; ++p) {
+        if (Traits::isLive(p->key))
+            set(p->key, p->get_value());
+    }
+    delete_array<Alloc>(old_table, old_table_end - old_table);
+}
+
+#ifdef HAVE_PTHREADS
+// Rehashing an OpenTable on several threads. In the first phase, each thread
+// initializes its share of the new slots. In the second, each one inserts the
+// live entries from its share of the old slots, claiming an empty slot with a
+// compare-and-swap on its key. The probe sequence is the same as set()'s.
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+struct BasicOpenTable<K, V, HashPolicy, Traits, Alloc>::RehashJob {
+    enum Phase { Init, Insert };
+
+    const Entry *old_table;
+    size_t old_capacity;
+    Entry *new_table;
+    size_t new_capacity;
+    unsigned threads;
+    Phase phase;
+
+    RehashJob(const BasicOpenTable &t, size_t capacity, unsigned n)
+      : old_table(t.table), old_capacity(t.mask + 1),
+        new_table(static_cast<Entry *>(Alloc::allocate(capacity * sizeof(Entry)))),
+        new_capacity(capacity), threads(n), phase(Init) {}
+
+    void run(unsigned i) {
+        if (phase == Init) {
+            for (size_t j = part(new_capacity, threads, i), end = part(new_capacity, threads, i + 1); j < end; j++)
+                new (&new_table[j]) Entry;
+            return;
+        }
+
+        Key empty;
+        Traits::makeEmpty(empty);
+        size_t new_mask = new_capacity - 1;
+        for (size_t j = part(old_capacity, threads, i), end = part(old_capacity, threads, i + 1); j < end; j++) {
+            const Entry &e = old_table[j];
+            if (!Traits::isLive(e.key))
+                continue;
+            hashcode_t h = hash_key(e.key);
+            size_t k = h & new_mask;
+            h >>= 3;
+            while (!AtomicKey<Key>::claim(new_table[k].key, empty, e.key))
+                k = (k + (h | 1)) & new_mask;
+            new_table[k].set_value(e.get_value());
+        }
+    }
+};
+#endif
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+size_t
+BasicOpenTable<K, V, HashPolicy, Traits, Alloc>::byte_size(ByteSizeOption) const
+{
+    return sizeof(*this) + (mask + 1) * sizeof(Entry);
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+size_t
+BasicOpenTable<K, V, HashPolicy, Traits, Alloc>::size() const
+{
+    return live_count;
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+bool
+BasicOpenTable<K, V, HashPolicy, Traits, Alloc>::has(KeyArg key) const
+{
+    return lookup(key) != NULL;
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+typename BasicOpenTable<K, V, HashPolicy, Traits, Alloc>::Value
+BasicOpenTable<K, V, HashPolicy, Traits, Alloc>::get(KeyArg key) const
+{
+    const Entry *e = lookup(key);
+    return e ? e->get_value() : Value();
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+void
+BasicOpenTable<K, V, HashPolicy, Traits, Alloc>::set(KeyArg key, ValueArg value)
+{
+    // In a set, setting a key to false removes it. (For a map this is
+    // compiled out.)
+    if (!Entry::present(value)) {
+        remove(key);
+        return;
+    }
+
+    // The key may be further along the probe sequence than a tombstone, so
+    // keep going until an empty entry, then reuse the first tombstone seen.
+    hashcode_t h = hash_key(key);
+    size_t i = h & mask;
+    h >>= 3;
+    Entry *tomb = NULL;
+    while (!Traits::isEmpty(table[i].key)) {
+        if (Traits::equal(table[i].key, key)) {
+            table[i].set_value(value);
+            return;
+        }
+        if (!tomb && Traits::isTombstone(table[i].key))
+            tomb = &table[i];
+        i = (i + (h | 1)) & mask;
+    }
+
+    Entry *e = tomb ? tomb : &table[i];
+    e->key = key;
+    e->set_value(value);
+    live_count++;
+    if (!tomb)
+        nonempty_count++;
+    if (nonempty_count > (mask + 1) * max_fill_ratio())
+        rehash((mask + 1) << 1);
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+bool
+BasicOpenTable<K, V, HashPolicy, Traits, Alloc>::remove(KeyArg key)
+{
+    Entry *e = lookup(key, hash_key(key));
+    if (!e)
+        return false;
+    Traits::makeTombstone(e->key);
+    live_count--;
+    if (mask > 7 && live_count < (mask + 1) * min_fill_ratio())
+        rehash((mask + 1) >> 1);
+    return true;
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+void
+BasicOpenTable<K, V, HashPolicy, Traits, Alloc>::get_many(const Key *keys, Value *values, size_t n) const
+{
+    const Entry *found[BatchSize];
+    for (size_t base = 0; base < n; base += BatchSize) {
+        size_t m = n - base < size_t(BatchSize) ? n - base : size_t(BatchSize);
+        lookup_batch(keys + base, m, found);
+        for (size_t j = 0; j < m; j++)
+            values[base + j] = found[j] ? found[j]->get_value() : Value();
+    }
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+void
+BasicOpenTable<K, V, HashPolicy, Traits, Alloc>::has_many(const Key *keys, bool *results, size_t n) const
+{
+    const Entry *found[BatchSize];
+    for (size_t base = 0; base < n; base += BatchSize) {
+        size_t m = n - base < size_t(BatchSize) ? n - base : size_t(BatchSize);
+        lookup_batch(keys + base, m, found);
+        for (size_t j = 0; j < m; j++)
+            results[base + j] = found[j] != NULL;
+    }
+}
+
+// The smallest table size that can hold n entries without rehashing.
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+size_t
+BasicOpenTable<K, V, HashPolicy, Traits, Alloc>::capacity_for(size_t n)
+{
+    size_t capacity = 8;
+    while (n > capacity * max_fill_ratio())
+        capacity <<= 1;
+    return capacity;
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+void
+BasicOpenTable<K, V, HashPolicy, Traits, Alloc>::reserve(size_t n)
+{
+    size_t capacity = capacity_for(n);
+    if (capacity > mask + 1)
+        rehash(capacity);
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+void
+BasicOpenTable<K, V, HashPolicy, Traits, Alloc>::shrink_to_fit()
+{
+    size_t capacity = capacity_for(live_count);
+    if (capacity != mask + 1 || nonempty_count != live_count)
+        rehash(capacity);
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+void
+BasicOpenTable<K, V, HashPolicy, Traits, Alloc>::assign(const Key *keys, const Value *values, size_t n)
+{
+    delete_array<Alloc>(table, mask + 1);
+    size_t capacity = capacity_for(n);
+    table = new_array<Entry, Alloc>(capacity);
+    mask = capacity - 1;
+    live_count = 0;
+    nonempty_count = 0;
+    for (size_t i = 0; i < n; i++)
+        set(keys[i], values[i]);
+}
+
+#ifdef TABLE_STATS
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+TableStats
+BasicOpenTable<K, V, HashPolicy, Traits, Alloc>::stats() const
+{
+    TableStats s;
+    static_cast<TableCounters &>(s) = counters;
+    s.live = live_count;
+    s.buckets = mask + 1;
+    s.dead_fraction = double(nonempty_count - live_count) / (mask + 1);
+    for (size_t i = 0; i < TableStats::HistogramSize; i++)
+        s.histogram[i] = 0;
+
+    // Follow each live key's probe sequence to where it is.
+    for (size_t i = 0; i <= mask; i++) {
+        if (!Traits::isLive(table[i].key))
+            continue;
+        hashcode_t h = hash_key(table[i].key);
+        size_t j = h & mask;
+        size_t probes = 1;
+        h >>= 3;
+        while (j != i) {
+            j = (j + (h | 1)) & mask;
+            probes++;
+        }
+        s.histogram[probes < size_t(TableStats::HistogramSize) ? probes - 1 : TableStats::HistogramSize - 1]++;
+    }
+    return s;
+}
+#endif
+
+template class BasicOpenTable<Key, Value, IdentityHash>;
+template class BasicOpenTable<Key, Value, FibonacciHash>;
+template class BasicOpenTable<Key, Value, MixHash>;
+template class BasicOpenTable<Key, Value, MixHash, BoxedKeyTraits>;
+template class BasicOpenTable<StringKey, Value>;
+template class BasicOpenTable<Key, Value, MixHash, KeyTraits<Key>, PoolAllocator>;
+template class BasicOpenTable<Key, Value, MixHash, KeyTraits<Key>, ArenaAllocator>;
+template class BasicOpenTable<Key, void>;
+#ifdef HAVE_MMAP
+template class BasicOpenTable<Key, Value, MixHash, KeyTraits<Key>, HugePageAllocator>;
+#endif
+
+
+// === RobinHoodTable
+
+RobinHoodTable::RobinHoodTable()
+{
+    table = new Entry[8];
+    distances = new uint8_t[8];
+    memset(distances, 0, 8);
+    mask = 7;
+    live_count = 0;
+}
+
+RobinHoodTable::~RobinHoodTable()
+{
+    delete[] table;
+    delete[] distances;
+}
+
+// Return the index of the slot containing key, or size_t(-1).
+size_t
+RobinHoodTable::lookup(KeyArg key) const
+{
+    size_t i = MixHash::hash(key) & mask;
+    for (unsigned d = 1; ; d++) {
+        if (distances[i] < d)
+            return size_t(-1);
+        if (distances[i] == d && table[i].key == key)
+            return i;
+        i = (i + 1) & mask;
+    }
+}
+
+// Insert e, which must not already be in the table, displacing entries that
+// are closer to home. Return false if some entry would end up too far from
+// home; in that case e holds the entry that has no slot, and the table must
+// grow.
+bool
+RobinHoodTable::insert(Entry &e)
+{
+    size_t i = MixHash::hash(e.key) & mask;
+    for (unsigned d = 1; d < max_distance(); d++) {
+        if (distances[i] == 0) {
+            table[i] = e;
+            distances[i] = uint8_t(d);
+            return true;
+        }
+        if (distances[i] < d) {
+            Entry tmp = table[i];
+            table[i] = e;
+            e = tmp;
+            unsigned dtmp = distances[i];
+            distances[i] = uint8_t(d);
+            d = dtmp;
+        }
+        i = (i + 1) & mask;
+    }
+    return false;
+}
+
+void
+RobinHoodTable::rehash(size_t new_capacity)
+{
+    Entry *old_table = table;
+    uint8_t *old_distances = distances;
+    size_t old_capacity = mask + 1;
+
+    for (;;) {
+        table = new Entry[new_capacity];
+        distances = new uint8_t[new_capacity];
+        memset(distances, 0, new_capacity);
+        mask = new_capacity - 1;
+
+        bool ok = true;
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old_distances[i] != 0) {
+                Entry e = old_table[i];
+                if (!insert(e)) {
+                    ok = false;
+                    break;
+                }
+            }
+        }
+        if (ok)
+            break;
+
+        // Some probe sequence is still too long. Start over, bigger.
+        delete[] table;
+        delete[] distances;
+        new_capacity <<= 1;
+    }
+
+    delete[] old_table;
+    delete[] old_distances;
+}
+
+size_t
+RobinHoodTable::byte_size(ByteSizeOption) const
+{
+    return sizeof(*this) + (mask + 1) * (sizeof(Entry) + sizeof(uint8_t));
+}
+
+size_t
+RobinHoodTable::size() const
+{
+    return live_count;
+}
+
+bool
+RobinHoodTable::has(KeyArg key) const
+{
+    return lookup(key) != size_t(-1);
+}
+
+Value
+RobinHoodTable::get(KeyArg key) const
+{
+    size_t i = lookup(key);
+    return i != size_t(-1) ? table[i].value : Value();
+}
+
+void
+RobinHoodTable::set(KeyArg key, ValueArg value)
+{
+    size_t i = lookup(key);
+    if (i != size_t(-1)) {
+        table[i].value = value;
+        return;
+    }
+
+    if (live_count + 1 > (mask + 1) * max_fill_ratio())
+        rehash((mask + 1) << 1);
+    Entry e;
+    e.key = key;
+    e.value = value;
+    while (!insert(e))
+        rehash((mask + 1) << 1);
+    live_count++;
+}
+
+bool
+RobinHoodTable::remove(KeyArg key)
+{
+    size_t i = lookup(key);
+    if (i == size_t(-1))
+        return false;
+
+    // Shift the rest of the cluster back one slot, stopping at an empty slot
+    // or at an entry that is already in its home slot.
+    size_t j = (i + 1) & mask;
+    while (distances[j] > 1) {
+        table[i] = table[j];
+        distances[i] = uint8_t(distances[j] - 1);
+        i = j;
+        j = (j + 1) & mask;
+    }
+    distances[i] = 0;
+
+    live_count--;
+    if (mask > 7 && live_count < (mask + 1) * min_fill_ratio())
+        rehash((mask + 1) >> 1);
+    return true;
+}
+
+
+// === DenseTable
+
+#ifdef HAVE_SPARSEHASH
+
+DenseTable::DenseTable()
+{
+    Key k;
+    makeEmpty(k);
+    map.set_empty_key(k);
+    makeTombstone(k);
+    map.set_deleted_key(k);
+}
+
+size_t
+DenseTable::byte_size(ByteSizeOption) const
+{
+    return sizeof(*this) + sizeof(std::pair<const Key, Value>) * map.bucket_count();
+}
+
+size_t
+DenseTable::size() const
+{
+    return map.size();
+}
+
+bool
+DenseTable::has(KeyArg key) const
+{
+    return map.find(key) != map.end();
+}
+
+Value
+DenseTable::get(KeyArg key) const
+{
+    Map::const_iterator it = map.find(key);
+    return (it == map.end() ? Value() : it->second);
+}
+
+void
+DenseTable::set(KeyArg key, ValueArg value)
+{
+    map[key] = value;
+}
+
+bool
+DenseTable::remove(KeyArg key)
+{
+    Map::iterator it = map.find(key);
+    if (it == map.end())
+        return false;
+    map.erase(it);
+    size_t n = map.bucket_count();
+    if (n > 32 && map.size() <= n / 8)
+        map.resize(0);
+    return true;
+}
+
+#endif  // HAVE_SPARSEHASH
+
+
+// === CloseTable
+
+// The number of set bits in x.
+static inline size_t
+count_bits64(uint64_t x)
+{
+#if defined(__GNUC__)
+    return size_t(__builtin_popcountll(x));
+#else
+    size_t n = 0;
+    for (; x; x &= x - 1)
+        n++;
+    return n;
+#endif
+}
+
+// The index of the lowest set bit in x, which must be nonzero.
+static inline size_t
+lowest_bit64(uint64_t x)
+{
+#if defined(__GNUC__)
+    return size_t(__builtin_ctzll(x));
+#else
+    size_t i = 0;
+    while (!(x & 1)) {
+        x >>= 1;
+        i++;
+    }
+    return i;
+#endif
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::BasicCloseTable()
+{
+    size_t buckets = initial_buckets();
+    table = new_array<EntryPtr, Alloc>(buckets);
+    memset(table, 0, buckets * sizeof(EntryPtr));
+    table_mask = buckets - 1;
+    entries_capacity = size_t(buckets * fill_factor());
+    entries = new_array<Entry, Alloc>(entries_capacity);
+    entries_length = 0;
+    live_count = 0;
+    live_bits = new_live_bits(entries_capacity, 0);
+    iterators = NULL;
+    peak_bytes = 0;
+    note_peak(0);
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::BasicCloseTable(const BasicCloseTable &other)
+{
+    table = NULL;
+    entries = NULL;
+    table_mask = 0;
+    entries_capacity = 0;
+    live_bits = NULL;
+    iterators = NULL;
+    peak_bytes = 0;
+    copy_from(other);
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc> &
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::operator=(const BasicCloseTable &other)
+{
+    if (this != &other)
+        copy_from(other);
+    return *this;
+}
+
+// Replace this table's arrays with copies of other's. Entries keep their
+// indexes, so each chain pointer, in the hash table or in an entry, is
+// rebased from other.entries to the new entries vector as it is copied.
+// Nothing is rehashed.
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+void
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::copy_from(const BasicCloseTable &other)
+{
+    EntryPtr *new_table = new_array<EntryPtr, Alloc>(other.table_mask + 1);
+    Entry *new_entries = new_array<Entry, Alloc>(other.entries_capacity);
+
+    for (size_t i = 0; i <= other.table_mask; i++) {
+        Entry *e = other.table[i];
+        new_table[i] = e ? new_entries + (e - other.entries) : NULL;
+    }
+    for (size_t i = 0; i < other.entries_length; i++) {
+        const Entry &src = other.entries[i];
+        Entry &dst = new_entries[i];
+        dst.key = src.key;
+        dst.set_value(src.get_value());
+        dst.chain = src.chain ? new_entries + (src.chain - other.entries) : NULL;
+    }
+
+    uint64_t *new_bits = new_array<uint64_t, Alloc>(bit_words(other.entries_capacity));
+    memcpy(new_bits, other.live_bits, bit_words(other.entries_capacity) * sizeof(uint64_t));
+
+    size_t old_bytes = 0;
+    if (table) {
+        old_bytes = byte_size(BytesAllocated) - sizeof(*this);
+        delete_array<Alloc>(table, table_mask + 1);
+        delete_array<Alloc>(entries, entries_capacity);
+        delete_array<Alloc>(live_bits, bit_words(entries_capacity));
+    }
+    table = new_table;
+    table_mask = other.table_mask;
+    entries = new_entries;
+    entries_capacity = other.entries_capacity;
+    entries_length = other.entries_length;
+    live_count = other.live_count;
+    live_bits = new_bits;
+    note_peak(old_bytes);
+    restart_iterators();
+}
+
+// Raise peak_bytes to what is allocated now, plus extra bytes that are
+// allocated but not (or no longer) part of the table proper.
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+void
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::note_peak(size_t extra)
+{
+    size_t bytes = byte_size(BytesAllocated) + extra;
+    if (bytes > peak_bytes)
+        peak_bytes = bytes;
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::~BasicCloseTable()
+{
+    while (iterators)
+        iterators->detach();
+    delete_array<Alloc>(table, table_mask + 1);
+    delete_array<Alloc>(entries, entries_capacity);
+    delete_array<Alloc>(live_bits, bit_words(entries_capacity));
+}
+
+// Return a bit vector for an entries vector of the given capacity, with the
+// first live bits set.
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+uint64_t *
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::new_live_bits(size_t capacity, size_t live)
+{
+    uint64_t *bits = new_array<uint64_t, Alloc>(bit_words(capacity));
+    fill_live_bits(bits, capacity, live);
+    return bits;
+}
+
+// Set the first live bits of bits, and clear the rest.
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+void
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::fill_live_bits(uint64_t *bits, size_t capacity, size_t live)
+{
+    size_t words = bit_words(capacity);
+    memset(bits, 0xff, live / 64 * sizeof(uint64_t));
+    memset(bits + live / 64, 0, (words - live / 64) * sizeof(uint64_t));
+    if (live % 64)
+        bits[live / 64] = (uint64_t(1) << (live % 64)) - 1;
+}
+
+// Return the index of the first live entry at or after i, or entries_length
+// if there are none.
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+size_t
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::next_live(size_t i) const
+{
+    if (i >= entries_length)
+        return entries_length;
+    uint64_t bits = live_bits[i / 64] >> (i % 64);
+    if (bits)
+        return i + lowest_bit64(bits);
+    for (size_t w = i / 64 + 1, words = bit_words(entries_length); w < words; w++) {
+        if (live_bits[w])
+            return w * 64 + lowest_bit64(live_bits[w]);
+    }
+    return entries_length;
+}
+
+// Return the number of live entries before entries[i]: where entries[i] goes
+// when the table is rehashed.
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+size_t
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::live_before(size_t i) const
+{
+    size_t n = 0;
+    for (size_t w = 0; w < i / 64; w++)
+        n += count_bits64(live_bits[w]);
+    if (i % 64)
+        n += count_bits64(live_bits[i / 64] & ((uint64_t(1) << (i % 64)) - 1));
+    return n;
+}
+
+// Move every iterator to the first entry, after the contents are replaced.
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+void
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::restart_iterators()
+{
+    for (Iterator *i = iterators; i; i = i->next)
+        i->index = next_live(0);
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+typename BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::Entry *
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::lookup(KeyArg key, hashcode_t h)
+{
+    for (Entry *e = table[h & table_mask]; e; e = e->chain) {
+        if (Traits::equal(e->key, key))
+            return e;
+    }
+    return NULL;
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+const typename BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::Entry *
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::lookup(KeyArg key) const {
+#ifdef TABLE_STATS
+    return counted_lookup(key, hash_key(key));
+#else
+    return const_cast<BasicCloseTable *>(this)->lookup(key, hash_key(key));
+#endif
+}
+
+#ifdef TABLE_STATS
+// lookup(key, h), counting the entries looked at, as in BasicOpenTable.
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+const typename BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::Entry *
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::counted_lookup(KeyArg key, hashcode_t h) const
+{
+    size_t probes = 0;
+    for (const Entry *e = table[h & table_mask]; e; e = e->chain) {
+        probes++;
+        if (Traits::equal(e->key, key)) {
+            counters.count_lookup(true, probes);
+            return e;
+        }
+    }
+    counters.count_lookup(false, probes);
+    return NULL;
+}
+#endif
+
+// Look up keys[0..n), n <= BatchSize, storing the entries found (or NULL) in
+// found[0..n).
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+void
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::lookup_batch(const Key *keys, size_t n, const Entry **found) const
+{
+    size_t buckets[BatchSize];
+    for (size_t j = 0; j < n; j++) {
+        buckets[j] = hash_key(keys[j]) & table_mask;
+        prefetch(&table[buckets[j]]);
+    }
+    for (size_t j = 0; j < n; j++) {
+        found[j] = table[buckets[j]];
+        if (found[j])
+            prefetch(found[j]);
+    }
+    for (size_t j = 0; j < n; j++) {
+        const Entry *e = found[j];
+#ifdef TABLE_STATS
+        size_t probes = e ? 1 : 0;
+        while (e && !Traits::equal(e->key, keys[j])) {
+            e = e->chain;
+            if (e)
+                probes++;
+        }
+        counters.count_lookup(e != NULL, probes);
+#else
+        while (e && !Traits::equal(e->key, keys[j]))
+            e = e->chain;
+#endif
+        found[j] = e;
+    }
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+void
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::rehash(size_t new_table_mask)
+{
+#ifdef TABLE_STATS
+    RehashTimer timer(counters, table_mask + 1, new_table_mask + 1);
+#endif
+    size_t new_capacity = size_t((new_table_mask + 1) * fill_factor());
+    if (new_capacity == entries_capacity
+        || Alloc::can_reallocate(entries_capacity * sizeof(Entry), new_capacity * sizeof(Entry)))
+    {
+        rehash_in_place(new_table_mask, new_capacity);
+        return;
+    }
+
+    EntryPtr *new_table = new_array<EntryPtr, Alloc>(new_table_mask + 1);
+    Entry *new_entries = new_array<Entry, Alloc>(new_capacity);
+
+#ifdef HAVE_PTHREADS
+    unsigned threads = rehash_threads(entries_length);
+    if (threads > 1) {
+        RehashJob job(*this, new_table, new_table_mask, new_entries, threads);
+        run_parallel(job, threads);
+        job.start_copying();
+        run_parallel(job, threads);
+    } else
+#endif
+    {
+        memset(new_table, 0, (new_table_mask + 1) * sizeof(EntryPtr));
+        Entry *q = new_entries;
+        for (Entry *p = entries, *end = entries + entries_length; p != end; p++) {
+            if (!Traits::isEmpty(p->key)) {
+                hashcode_t h = hash_key(p->key) & new_table_mask;
+                q->key = p->key;
+                q->set_value(p->get_value());
+                q->chain = new_table[h];
+                new_table[h] = q;
+                q++;
+            }
+        }
+    }
+
+    // Rehashing squeezes out the removed entries; move each iterator to
+    // where its entry went. (An iterator that is done stays done.)
+    for (Iterator *i = iterators; i; i = i->next)
+        i->index = live_before(i->index);
+
+    note_peak((new_table_mask + 1) * sizeof(EntryPtr) + new_capacity * sizeof(Entry));
+    delete_array<Alloc>(table, table_mask + 1);
+    delete_array<Alloc>(entries, entries_capacity);
+    delete_array<Alloc>(live_bits, bit_words(entries_capacity));
+    table = new_table;
+    table_mask = new_table_mask;
+    entries = new_entries;
+    entries_capacity = new_capacity;
+    entries_length = live_count;
+    live_bits = new_live_bits(entries_capacity, live_count);
+}
+
+// Rehash without a second entries vector. The live entries slide down to the
+// front of the vector, keeping their order; the vector is resized in place
+// (by Alloc::reallocate) if its capacity changes; then the chains are rebuilt
+// from scratch. So this never holds two entries vectors at once, where
+// rehash() briefly needs both. set() purging removed entries from a full
+// table always comes here, since the capacity stays the same.
+//
+// In a big table, the chains are rebuilt on several threads (RelinkJob), as
+// rehash() does. The slide stays on one thread: it is one sequential pass,
+// and splitting it up would have threads writing entries that other threads
+// have yet to read.
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+void
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::rehash_in_place(size_t new_table_mask,
+                                                                  size_t new_capacity)
+{
+    // Grow before sliding, and shrink after, so that the live entries are
+    // always inside the vector.
+    size_t old_capacity = entries_capacity;
+    if (new_capacity > entries_capacity) {
+        entries = resize_array<Entry, Alloc>(entries, entries_capacity, new_capacity);
+        entries_capacity = new_capacity;
+        note_peak(0);
+    }
+
+    for (Iterator *i = iterators; i; i = i->next)
+        i->index = live_before(i->index);
+
+    Entry *q = entries;
+    for (size_t i = next_live(0); i < entries_length; i = next_live(i + 1)) {
+        if (q != &entries[i])
+            *q = entries[i];
+        q++;
+    }
+    for (Entry *end = entries + entries_length; q != end; q++)
+        Traits::makeEmpty(q->key);
+    entries_length = live_count;
+
+    if (new_capacity < entries_capacity) {
+        entries = resize_array<Entry, Alloc>(entries, entries_capacity, new_capacity);
+        entries_capacity = new_capacity;
+    }
+
+    // The old bucket array is no use now, so free it before allocating the
+    // new one.
+    if (new_table_mask != table_mask) {
+        delete_array<Alloc>(table, table_mask + 1);
+        table = new_array<EntryPtr, Alloc>(new_table_mask + 1);
+        table_mask = new_table_mask;
+    }
+#ifdef HAVE_PTHREADS
+    unsigned threads = rehash_threads(entries_length);
+    if (threads > 1) {
+        RelinkJob job(*this, threads);
+        run_parallel(job, threads);
+        job.phase = RelinkJob::Link;
+        run_parallel(job, threads);
+    } else
+#endif
+    {
+        memset(table, 0, (table_mask + 1) * sizeof(EntryPtr));
+        for (Entry *p = entries, *end = entries + entries_length; p != end; p++) {
+            hashcode_t h = hash_key(p->key) & table_mask;
+            p->chain = table[h];
+            table[h] = p;
+        }
+    }
+
+    if (bit_words(entries_capacity) != bit_words(old_capacity)) {
+        delete_array<Alloc>(live_bits, bit_words(old_capacity));
+        live_bits = new_live_bits(entries_capacity, live_count);
+    } else {
+        fill_live_bits(live_bits, entries_capacity, live_count);
+    }
+    note_peak(0);
+}
+
+#ifdef HAVE_PTHREADS
+// Rehashing a CloseTable on several threads. The old entries vector is split
+// into one range per thread. In the first phase, each thread counts the live
+// entries in its range (and clears its share of the new buckets). A prefix
+// sum of the counts tells each thread where its entries start in the new
+// vector, so that they stay in exactly the order they were in. In the second
+// phase, each thread copies its entries there and links each one into its
+// bucket with an atomic exchange. The order of entries within a chain then
+// depends on timing, but lookups don't care.
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+struct BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::RehashJob {
+    enum Phase { Count, Copy };
+
+    const Entry *old_entries;
+    size_t old_length;
+    EntryPtr *new_table;
+    size_t new_table_mask;
+    Entry *new_entries;
+    unsigned threads;
+    Phase phase;
+    vector<size_t> starts;      // live counts per range, then where each range goes
+
+    RehashJob(const BasicCloseTable &t, EntryPtr *table, size_t mask, Entry *entries, unsigned n)
+      : old_entries(t.entries), old_length(t.entries_length), new_table(table),
+        new_table_mask(mask), new_entries(entries), threads(n), phase(Count), starts(n) {}
+
+    void start_copying() {
+        size_t total = 0;
+        for (unsigned i = 0; i < threads; i++) {
+            size_t count = starts[i];
+            starts[i] = total;
+            total += count;
+        }
+        phase = Copy;
+    }
+
+    void run(unsigned i) {
+        size_t begin = part(old_length, threads, i), end = part(old_length, threads, i + 1);
+        if (phase == Count) {
+            size_t buckets = new_table_mask + 1;
+            size_t b = part(buckets, threads, i);
+            memset(new_table + b, 0, (part(buckets, threads, i + 1) - b) * sizeof(EntryPtr));
+
+            size_t count = 0;
+            for (size_t j = begin; j < end; j++)
+                count += !Traits::isEmpty(old_entries[j].key);
+            starts[i] = count;
+            return;
+        }
+
+        Entry *q = new_entries + starts[i];
+        for (size_t j = begin; j < end; j++) {
+            const Entry *p = &old_entries[j];
+            if (!Traits::isEmpty(p->key)) {
+                hashcode_t h = hash_key(p->key) & new_table_mask;
+                q->key = p->key;
+                q->set_value(p->get_value());
+                q->chain = __atomic_exchange_n(&new_table[h], q, __ATOMIC_RELAXED);
+                q++;
+            }
+        }
+    }
+};
+
+// Rebuilding the chains in rehash_in_place on several threads. In the first
+// phase, each thread clears its share of the buckets; in the second, it links
+// its share of the (already compacted) entries into their buckets with an
+// atomic exchange, as in RehashJob.
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+struct BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::RelinkJob {
+    enum Phase { Clear, Link };
+
+    EntryPtr *table;
+    size_t table_mask;
+    Entry *entries;
+    size_t length;
+    unsigned threads;
+    Phase phase;
+
+    RelinkJob(BasicCloseTable &t, unsigned n)
+      : table(t.table), table_mask(t.table_mask), entries(t.entries),
+        length(t.entries_length), threads(n), phase(Clear) {}
+
+    void run(unsigned i) {
+        if (phase == Clear) {
+            size_t buckets = table_mask + 1;
+            size_t b = part(buckets, threads, i);
+            memset(table + b, 0, (part(buckets, threads, i + 1) - b) * sizeof(EntryPtr));
+            return;
+        }
+
+        for (size_t j = part(length, threads, i), end = part(length, threads, i + 1); j < end; j++) {
+            Entry *p = &entries[j];
+            hashcode_t h = hash_key(p->key) & table_mask;
+            p->chain = __atomic_exchange_n(&table[h], p, __ATOMIC_RELAXED);
+        }
+    }
+};
+#endif
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+size_t
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::byte_size(ByteSizeOption option) const
+{
+    if (option == BytesPeak)
+        return peak_bytes;
+    size_t n = option == BytesAllocated ? entries_capacity : entries_length;
+    return sizeof(*this)
+        + (table_mask + 1) * sizeof(EntryPtr)
+        + n * sizeof(Entry)
+        + bit_words(n) * sizeof(uint64_t);
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+size_t
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::size() const
+{
+    return live_count;
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+bool
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::has(KeyArg key) const
+{
+    return lookup(key) != NULL;
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+typename BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::Value
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::get(KeyArg key) const
+{
+    const Entry *e = lookup(key);
+    return e ? e->get_value() : Value();
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+void
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::set(KeyArg key, ValueArg value)
+{
+    // In a set, setting a key to false removes it.
+    if (!Entry::present(value)) {
+        remove(key);
+        return;
+    }
+
+    hashcode_t h = hash_key(key);
+    Entry *e = lookup(key, h);
+    if (e) {
+        e->set_value(value);
+    } else {
+        if (entries_length == entries_capacity) {
+            // If the table is more than 1/4 deleted entries, simply rehash in
+            // place to free up some space. Otherwise, grow the table.
+            rehash(live_count >= entries_capacity * 0.75
+                   ? (table_mask << 1) | 1
+                   : table_mask);
+        }
+        h &= table_mask;
+        live_count++;
+        live_bits[entries_length / 64] |= uint64_t(1) << (entries_length % 64);
+        e = &entries[entries_length++];
+        e->key = key;
+        e->set_value(value);
+        e->chain = table[h];
+        table[h] = e;
+    }
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+bool
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::remove(KeyArg key)
+{
+    // If an entry exists for the given key, empty it.
+    Entry *e = lookup(key, hash_key(key));
+    if (e == NULL)
+        return false;
+    live_count--;
+    Traits::makeEmpty(e->key);
+    size_t i = e - entries;
+    live_bits[i / 64] &= ~(uint64_t(1) << (i % 64));
+
+    // Iterators on the removed entry move on to the next one.
+    for (Iterator *it = iterators; it; it = it->next) {
+        if (it->index == i)
+            it->index = next_live(i);
+    }
+
+    // If many entries have been removed, shrink the table.
+    if (table_mask > initial_buckets() && live_count < entries_length * min_vector_fill())
+        rehash(table_mask >> 1);
+    return true;
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+void
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::get_many(const Key *keys, Value *values, size_t n) const
+{
+    const Entry *found[BatchSize];
+    for (size_t base = 0; base < n; base += BatchSize) {
+        size_t m = n - base < size_t(BatchSize) ? n - base : size_t(BatchSize);
+        lookup_batch(keys + base, m, found);
+        for (size_t j = 0; j < m; j++)
+            values[base + j] = found[j] ? found[j]->get_value() : Value();
+    }
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+void
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::has_many(const Key *keys, bool *results, size_t n) const
+{
+    const Entry *found[BatchSize];
+    for (size_t base = 0; base < n; base += BatchSize) {
+        size_t m = n - base < size_t(BatchSize) ? n - base : size_t(BatchSize);
+        lookup_batch(keys + base, m, found);
+        for (size_t j = 0; j < m; j++)
+            results[base + j] = found[j] != NULL;
+    }
+}
+
+// The smallest number of buckets whose entries vector holds n entries.
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+size_t
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::buckets_for(size_t n)
+{
+    size_t buckets = initial_buckets();
+    while (size_t(buckets * fill_factor()) < n)
+        buckets <<= 1;
+    return buckets;
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+void
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::reserve(size_t n)
+{
+    if (n > entries_capacity)
+        rehash(buckets_for(n) - 1);
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+void
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::shrink_to_fit()
+{
+    size_t new_table_mask = buckets_for(live_count) - 1;
+    if (new_table_mask != table_mask || entries_length != live_count)
+        rehash(new_table_mask);
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+void
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::assign(const Key *keys, const Value *values, size_t n)
+{
+    // The fast path below can't take keys out again, so a set assigned any
+    // false values is cleared and filled in the ordinary way.
+    for (size_t i = 0; i < n; i++) {
+        if (!Entry::present(values[i])) {
+            assign(keys, values, 0);
+            reserve(n);
+            for (size_t j = 0; j < n; j++)
+                set(keys[j], values[j]);
+            return;
+        }
+    }
+
+    delete_array<Alloc>(table, table_mask + 1);
+    delete_array<Alloc>(entries, entries_capacity);
+    delete_array<Alloc>(live_bits, bit_words(entries_capacity));
+
+    size_t buckets = buckets_for(n);
+    table = new_array<EntryPtr, Alloc>(buckets);
+    memset(table, 0, buckets * sizeof(EntryPtr));
+    table_mask = buckets - 1;
+    entries_capacity = size_t(buckets * fill_factor());
+    entries = new_array<Entry, Alloc>(entries_capacity);
+
+    // There is room for every key, so this is set() without the check for a
+    // full entries vector.
+    Entry *q = entries;
+    for (size_t i = 0; i < n; i++) {
+        hashcode_t h = hash_key(keys[i]);
+        Entry *e = lookup(keys[i], h);
+        if (e) {
+            e->set_value(values[i]);
+        } else {
+            h &= table_mask;
+            q->key = keys[i];
+            q->set_value(values[i]);
+            q->chain = table[h];
+            table[h] = q;
+            q++;
+        }
+    }
+    entries_length = live_count = q - entries;
+    live_bits = new_live_bits(entries_capacity, live_count);
+    note_peak(0);
+    restart_iterators();
+}
+
+#ifdef TABLE_STATS
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+TableStats
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::stats() const
+{
+    TableStats s;
+    static_cast<TableCounters &>(s) = counters;
+    s.live = live_count;
+    s.buckets = table_mask + 1;
+    s.dead_fraction = entries_length ? double(entries_length - live_count) / entries_length : 0;
+    for (size_t i = 0; i < TableStats::HistogramSize; i++)
+        s.histogram[i] = 0;
+    for (size_t i = 0; i <= table_mask; i++) {
+        size_t length = 0;
+        for (const Entry *e = table[i]; e; e = e->chain)
+            length++;
+        s.histogram[length < size_t(TableStats::HistogramSize) ? length : TableStats::HistogramSize - 1]++;
+    }
+    return s;
+}
+#endif
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+typename BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::Iterator
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::begin() const
+{
+    Iterator i;
+    i.attach(this, next_live(0));
+    return i;
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::Iterator::Iterator()
+  : owner(NULL), index(0), prev(NULL), next(NULL)
+{
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::Iterator::Iterator(const Iterator &other)
+  : owner(NULL), index(0), prev(NULL), next(NULL)
+{
+    if (other.owner)
+        attach(other.owner, other.index);
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+typename BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::Iterator &
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::Iterator::operator=(const Iterator &other)
+{
+    if (this != &other) {
+        detach();
+        if (other.owner)
+            attach(other.owner, other.index);
+    }
+    return *this;
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::Iterator::~Iterator()
+{
+    detach();
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+void
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::Iterator::attach(const BasicCloseTable *t, size_t i)
+{
+    owner = t;
+    index = i;
+    prev = NULL;
+    next = t->iterators;
+    if (next)
+        next->prev = this;
+    t->iterators = this;
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+void
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::Iterator::detach()
+{
+    if (!owner)
+        return;
+    if (prev)
+        prev->next = next;
+    else
+        owner->iterators = next;
+    if (next)
+        next->prev = prev;
+    owner = NULL;
+    prev = next = NULL;
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+bool
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::Iterator::done() const
+{
+    return !owner || index >= owner->entries_length;
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+const typename BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::Key &
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::Iterator::key() const
+{
+    return owner->entries[index].key;
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+typename BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::Value
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::Iterator::value() const
+{
+    return owner->entries[index].get_value();
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+typename BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::Iterator &
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::Iterator::operator++()
+{
+    index = owner->next_live(index + 1);
+    return *this;
+}
+
+template <class K, class V, class HashPolicy, class Traits, class Alloc>
+bool
+BasicCloseTable<K, V, HashPolicy, Traits, Alloc>::Iterator::operator==(const Iterator &other) const
+{
+    bool a = done(), b = other.done();
+    if (a || b)
+        return a == b;
+    return owner == other.owner && index == other.index;
+}
+
+template class BasicCloseTable<Key, Value, IdentityHash>;
+template class BasicCloseTable<Key, Value, FibonacciHash>;
+template class BasicCloseTable<Key, Value, MixHash>;
+template class BasicCloseTable<Key, Value, MixHash, BoxedKeyTraits>;
+template class BasicCloseTable<StringKey, Value>;
+template class BasicCloseTable<Key, Value, MixHash, KeyTraits<Key>, PoolAllocator>;
+template class BasicCloseTable<Key, Value, MixHash, KeyTraits<Key>, ArenaAllocator>;
+template class BasicCloseTable<Key, void>;
+#ifdef HAVE_MMAP
+template class BasicCloseTable<Key, Value, MixHash, KeyTraits<Key>, HugePageAllocator>;
+#endif
+
+
+// === IncrementalCloseTable
+
+// Bucket arrays are allocated with calloc rather than new[] and memset, so
+// that large ones come straight from zeroed pages instead of being cleared
+// in a single long call.
+
+IncrementalCloseTable::IncrementalCloseTable()
+{
+    size_t buckets = initial_buckets();
+    table = static_cast<EntryPtr *>(calloc(buckets, sizeof(EntryPtr)));
+    table_mask = buckets - 1;
+    entries_capacity = size_t(buckets * fill_factor());
+    entries = new Entry[entries_capacity];
+    entries_length = 0;
+    live_count = 0;
+    old_table = NULL;
+    old_entries = NULL;
+}
+
+IncrementalCloseTable::~IncrementalCloseTable()
+{
+    free(table);
+    delete[] entries;
+    free(old_table);
+    delete[] old_entries;
+}
+
+IncrementalCloseTable::Entry *
+IncrementalCloseTable::lookup(KeyArg key, hashcode_t h)
+{
+    for (Entry *e = table[h & table_mask]; e; e = e->chain) {
+        if (e->key == key)
+            return e;
+    }
+    if (old_table) {
+        // Entries that have already been moved are emptied in the old
+        // vector, so this only finds entries that haven't.
+        for (Entry *e = old_table[h & old_table_mask]; e; e = e->chain) {
+            if (e->key == key)
+                return e;
+        }
+    }
+    return NULL;
+}
+
+void
+IncrementalCloseTable::start_rehash(size_t new_table_mask)
+{
+    old_table = table;
+    old_table_mask = table_mask;
+    old_entries = entries;
+    old_capacity = entries_capacity;
+    old_length = entries_length;
+    migrate_index = 0;
+
+    table = static_cast<EntryPtr *>(calloc(new_table_mask + 1, sizeof(EntryPtr)));
+    table_mask = new_table_mask;
+    entries_capacity = size_t((new_table_mask + 1) * fill_factor());
+    entries = new Entry[entries_capacity];
+    migrated_length = 0;
+    reserved_length = live_count;
+    entries_length = live_count;
+}
+
+// Move up to count old entries (live or not) into the new arrays.
+void
+IncrementalCloseTable::rehash_some(size_t count)
+{
+    size_t stop = old_length - migrate_index < count ? old_length : migrate_index + count;
+    for (Entry *p = old_entries + migrate_index, *end = old_entries + stop; p != end; p++) {
+        if (!isEmpty(p->key)) {
+            hashcode_t h = MixHash::hash(p->key) & table_mask;
+            Entry *q = &entries[migrated_length++];
+            q->key = p->key;
+            q->value = p->value;
+            q->chain = table[h];
+            table[h] = q;
+            makeEmpty(p->key);
+        }
+    }
+    migrate_index = stop;
+    if (migrate_index == old_length)
+        finish_rehash();
+}
+
+void
+IncrementalCloseTable::finish_rehash()
+{
+    // Old entries removed during the rehash leave holes at the end of the
+    // reserved range.
+    for (Entry *q = entries + migrated_length, *end = entries + reserved_length; q != end; q++)
+        makeEmpty(q->key);
+
+    free(old_table);
+    delete[] old_entries;
+    old_table = NULL;
+    old_entries = NULL;
+}
+
+size_t
+IncrementalCloseTable::byte_size(ByteSizeOption option) const
+{
+    size_t n = sizeof(*this)
+        + (table_mask + 1) * sizeof(EntryPtr)
+        + (option != BytesWritten ? entries_capacity : entries_length) * sizeof(Entry);
+    if (old_table) {
+        n += (old_table_mask + 1) * sizeof(EntryPtr)
+            + (option != BytesWritten ? old_capacity : old_length) * sizeof(Entry);
+    }
+    return n;
+}
+
+size_t
+IncrementalCloseTable::size() const
+{
+    return live_count;
+}
+
+bool
+IncrementalCloseTable::has(KeyArg key)
+{
+    if (old_table)
+        rehash_some(rehash_step());
+    return lookup(key, MixHash::hash(key)) != NULL;
+}
+
+Value
+IncrementalCloseTable::get(KeyArg key)
+{
+    if (old_table)
+        rehash_some(rehash_step());
+    const Entry *e = lookup(key, MixHash::hash(key));
+    return e ? e->value : Value();
+}
+
+void
+IncrementalCloseTable::set(KeyArg key, ValueArg value)
+{
+    if (old_table)
+        rehash_some(rehash_step());
+
+    hashcode_t h = MixHash::hash(key);
+    Entry *e = lookup(key, h);
+    if (e) {
+        e->value = value;
+    } else {
+        if (entries_length == entries_capacity) {
+            // This can only happen during a rehash if rehash_step() is too
+            // small; in that case, finish it the slow way.
+            if (old_table)
+                rehash_some(old_length);
+            if (entries_length == entries_capacity) {
+                start_rehash(live_count >= entries_capacity * 0.75
+                             ? (table_mask << 1) | 1
+                             : table_mask);
+            }
+        }
+        h &= table_mask;
+        live_count++;
+        e = &entries[entries_length++];
+        e->key = key;
+        e->value = value;
+        e->chain = table[h];
+        table[h] = e;
+    }
+}
+
+bool
+IncrementalCloseTable::remove(KeyArg key)
+{
+    if (old_table)
+        rehash_some(rehash_step());
+
+    Entry *e = lookup(key, MixHash::hash(key));
+    if (e == NULL)
+        return false;
+    live_count--;
+    makeEmpty(e->key);
+
+    // If many entries have been removed, start shrinking the table.
+    if (!old_table && table_mask > initial_buckets() && live_count < entries_length * min_vector_fill())
+        start_rehash(table_mask >> 1);
+    return true;
+}
+
+
+// === CompactCloseTable
+
+CompactCloseTable::CompactCloseTable()
+{
+    size_t buckets = initial_buckets();
+    table = new uint32_t[buckets];
+    memset(table, 0xff, buckets * sizeof(uint32_t));
+    table_mask = buckets - 1;
+    entries_capacity = size_t(buckets * fill_factor());
+    entries = new Entry[entries_capacity];
+    chains = new uint32_t[entries_capacity];
+    entries_length = 0;
+    live_count = 0;
+}
+
+CompactCloseTable::~CompactCloseTable()
+{
+    delete[] table;
+    delete[] entries;
+    delete[] chains;
+}
+
+// Return the index of the entry for key, or NoEntry.
+uint32_t
+CompactCloseTable::lookup(KeyArg key, hashcode_t h) const
+{
+    for (uint32_t i = table[h & table_mask]; i != NoEntry; i = chains[i]) {
+        if (entries[i].key == key)
+            return i;
+    }
+    return NoEntry;
+}
+
+void
+CompactCloseTable::rehash(size_t new_table_mask)
+{
+    size_t new_capacity = size_t((new_table_mask + 1) * fill_factor());
+    uint32_t *new_table = new uint32_t[new_table_mask + 1];
+    memset(new_table, 0xff, (new_table_mask + 1) * sizeof(uint32_t));
+    Entry *new_entries = new Entry[new_capacity];
+    uint32_t *new_chains = new uint32_t[new_capacity];
+
+    uint32_t q = 0;
+    for (Entry *p = entries, *end = entries + entries_length; p != end; p++) {
+        if (!isEmpty(p->key)) {
+            hashcode_t h = MixHash::hash(p->key) & new_table_mask;
+            new_entries[q] = *p;
+            new_chains[q] = new_table[h];
+            new_table[h] = q;
+            q++;
+        }
+    }
+
+    delete[] table;
+    delete[] entries;
+    delete[] chains;
+    table = new_table;
+    table_mask = new_table_mask;
+    entries = new_entries;
+    chains = new_chains;
+    entries_capacity = new_capacity;
+    entries_length = live_count;
+}
+
+size_t
+CompactCloseTable::byte_size(ByteSizeOption option) const
+{
+    return sizeof(*this)
+        + (table_mask + 1) * sizeof(uint32_t)
+        + (option != BytesWritten ? entries_capacity : entries_length) * (sizeof(Entry) + sizeof(uint32_t));
+}
+
+size_t
+CompactCloseTable::size() const
+{
+    return live_count;
+}
+
+bool
+CompactCloseTable::has(KeyArg key) const
+{
+    return lookup(key, MixHash::hash(key)) != NoEntry;
+}
+
+Value
+CompactCloseTable::get(KeyArg key) const
+{
+    uint32_t i = lookup(key, MixHash::hash(key));
+    return i != NoEntry ? entries[i].value : Value();
+}
+
+void
+CompactCloseTable::set(KeyArg key, ValueArg value)
+{
+    hashcode_t h = MixHash::hash(key);
+    uint32_t i = lookup(key, h);
+    if (i != NoEntry) {
+        entries[i].value = value;
+    } else {
+        if (entries_length == entries_capacity) {
+            // As in CloseTable::set.
+            rehash(live_count >= entries_capacity * 0.75
+                   ? (table_mask << 1) | 1
+                   : table_mask);
+        }
+        h &= table_mask;
+        live_count++;
+        i = uint32_t(entries_length++);
+        entries[i].key = key;
+        entries[i].value = value;
+        chains[i] = table[h];
+        table[h] = i;
+    }
+}
+
+bool
+CompactCloseTable::remove(KeyArg key)
+{
+    uint32_t i = lookup(key, MixHash::hash(key));
+    if (i == NoEntry)
+        return false;
+    live_count--;
+    makeEmpty(entries[i].key);
+
+    // If many entries have been removed, shrink the table.
+    if (table_mask > initial_buckets() && live_count < entries_length * min_vector_fill())
+        rehash(table_mask >> 1);
+    return true;
+}
+
+
+// === SwissCloseTable
+
+// Return a 16-bit mask with bit i set if group[i] == tag.
+static inline unsigned
+match_tag(const uint8_t *group, uint8_t tag)
+{
+#ifdef USE_SSE2
+    __m128i g = _mm_loadu_si128(reinterpret_cast<const __m128i *>(group));
+    return unsigned(_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(char(tag)))));
+#else
+    unsigned bits = 0;
+    for (unsigned i = 0; i < 16; i++)
+        bits |= unsigned(group[i] == tag) << i;
+    return bits;
+#endif
+}
+
+// Return a 16-bit mask with bit i set if group[i] is empty or deleted, that
+// is, if its high bit is set.
+static inline unsigned
+match_free(const uint8_t *group)
+{
+#ifdef USE_SSE2
+    return unsigned(_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(group))));
+#else
+    unsigned bits = 0;
+    for (unsigned i = 0; i < 16; i++)
+        bits |= unsigned(group[i] >> 7) << i;
+    return bits;
+#endif
+}
+
+// Return the index of the lowest set bit. bits must be nonzero.
+static inline unsigned
+lowest_bit(unsigned bits)
+{
+#if defined(__GNUC__)
+    return unsigned(__builtin_ctz(bits));
+#elif defined(_MSC_VER)
+    unsigned long i;
+    _BitScanForward(&i, bits);
+    return unsigned(i);
+#else
+    unsigned i = 0;
+    while (!(bits & 1)) {
+        bits >>= 1;
+        i++;
+    }
+    return i;
+#endif
+}
+
+SwissCloseTable::SwissCloseTable()
+{
+    size_t n = initial_slots();
+    tags = new uint8_t[n];
+    memset(tags, TagEmpty, n);
+    slots = new uint32_t[n];
+    slot_mask = n - 1;
+    entries_capacity = size_t(n * max_fill_ratio());
+    entries = new Entry[entries_capacity];
+    entries_length = 0;
+    live_count = 0;
+}
+
+SwissCloseTable::~SwissCloseTable()
+{
+    delete[] tags;
+    delete[] slots;
+    delete[] entries;
+}
+
+// Return the index of the slot that refers to key, or size_t(-1) if the key
+// is not in the table.
+size_t
+SwissCloseTable::lookup(KeyArg key, hashcode_t h) const
+{
+    size_t group_mask = slot_mask / group_size();
+    size_t g = (h >> 7) & group_mask;
+    uint8_t tag = uint8_t(h & 0x7f);
+    for (size_t step = 1; ; step++) {
+        const uint8_t *group = tags + g * group_size();
+        for (unsigned bits = match_tag(group, tag); bits; bits &= bits - 1) {
+            size_t i = g * group_size() + lowest_bit(bits);
+            if (entries[slots[i]].key == key)
+                return i;
+        }
+        if (match_tag(group, TagEmpty))
+            return size_t(-1);
+        g = (g + step) & group_mask;
+    }
+}
+
+// Return the index of the first empty or deleted slot in h's probe sequence.
+size_t
+SwissCloseTable::find_free_slot(hashcode_t h) const
+{
+    size_t group_mask = slot_mask / group_size();
+    size_t g = (h >> 7) & group_mask;
+    for (size_t step = 1; ; step++) {
+        unsigned bits = match_free(tags + g * group_size());
+        if (bits)
+            return g * group_size() + lowest_bit(bits);
+        g = (g + step) & group_mask;
+    }
+}
+
+void
+SwissCloseTable::rehash(size_t new_slot_mask)
+{
+    Entry *old_entries = entries;
+    Entry *old_end = entries + entries_length;
+
+    delete[] tags;
+    delete[] slots;
+    tags = new uint8_t[new_slot_mask + 1];
+    memset(tags, TagEmpty, new_slot_mask + 1);
+    slots = new uint32_t[new_slot_mask + 1];
+    slot_mask = new_slot_mask;
+    entries_capacity = size_t((new_slot_mask + 1) * max_fill_ratio());
+    entries = new Entry[entries_capacity];
+
+    Entry *q = entries;
+    for (Entry *p = old_entries; p != old_end; p++) {
+        if (!isEmpty(p->key)) {
+            hashcode_t h = FibonacciHash::hash(p->key);
+            size_t i = find_free_slot(h);
+            tags[i] = uint8_t(h & 0x7f);
+            slots[i] = uint32_t(q - entries);
+            *q++ = *p;
+        }
+    }
+
+    delete[] old_entries;
+    entries_length = live_count;
+}
+
+size_t
+SwissCloseTable::byte_size(ByteSizeOption option) const
+{
+    return sizeof(*this)
+        + (slot_mask + 1) * (sizeof(uint8_t) + sizeof(uint32_t))
+        + (option != BytesWritten ? entries_capacity : entries_length) * sizeof(Entry);
+}
+
+size_t
+SwissCloseTable::size() const
+{
+    return live_count;
+}
+
+bool
+SwissCloseTable::has(KeyArg key) const
+{
+    return lookup(key, FibonacciHash::hash(key)) != size_t(-1);
+}
+
+Value
+SwissCloseTable::get(KeyArg key) const
+{
+    size_t i = lookup(key, FibonacciHash::hash(key));
+    return i != size_t(-1) ? entries[slots[i]].value : Value();
+}
+
+void
+SwissCloseTable::set(KeyArg key, ValueArg value)
+{
+    hashcode_t h = FibonacciHash::hash(key);
+    size_t i = lookup(key, h);
+    if (i != size_t(-1)) {
+        entries[slots[i]].value = value;
+        return;
+    }
+
+    if (entries_length == entries_capacity) {
+        // As in CloseTable::set: purge deleted entries if there are enough
+        // of them, otherwise grow.
+        rehash(live_count >= entries_capacity * 0.75
+               ? (slot_mask << 1) | 1
+               : slot_mask);
+    }
+    i = find_free_slot(h);
+    tags[i] = uint8_t(h & 0x7f);
+    slots[i] = uint32_t(entries_length);
+    Entry *e = &entries[entries_length++];
+    e->key = key;
+    e->value = value;
+    live_count++;
+}
+
+bool
+SwissCloseTable::remove(KeyArg key)
+{
+    size_t i = lookup(key, FibonacciHash::hash(key));
+    if (i == size_t(-1))
+        return false;
+    tags[i] = TagDeleted;
+    makeEmpty(entries[slots[i]].key);
+    live_count--;
+
+    // If many entries have been removed, shrink the table.
+    if (slot_mask + 1 > initial_slots() && live_count < entries_length * min_vector_fill())
+        rehash(slot_mask >> 1);
+    return true;
+}
+
+
+// === BucketCloseTable
+
+// Compare the BucketSlots (10) fragments of a bucket to f. Return a mask
+// with bit 2*i set if fragments[i] == f; the odd bits are junk. (With SSE2,
+// this is two overlapping 8-way compares, which leave two mask bits per
+// slot.)
+static inline unsigned
+match_fragment(const uint16_t *fragments, uint16_t f)
+{
+#ifdef USE_SSE2
+    __m128i key = _mm_set1_epi16(short(f));
+    unsigned lo = unsigned(_mm_movemask_epi8(_mm_cmpeq_epi16(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(fragments)), key)));
+    unsigned hi = unsigned(_mm_movemask_epi8(_mm_cmpeq_epi16(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(fragments + 2)), key)));
+    return lo | (hi << 4);
+#else
+    unsigned bits = 0;
+    for (unsigned i = 0; i < 10; i++)
+        bits |= unsigned(fragments[i] == f) << (2 * i);
+    return bits;
+#endif
+}
+
+BucketCloseTable::BucketCloseTable()
+{
+    size_t n = initial_buckets();
+    bucket_memory = NULL;
+    allocate_buckets(n, n);
+    table_mask = n - 1;
+    entries_capacity = size_t(n * fill_factor());
+    entries = new Entry[entries_capacity];
+    entries_length = 0;
+    live_count = 0;
+}
+
+BucketCloseTable::~BucketCloseTable()
+{
+    delete[] bucket_memory;
+    delete[] entries;
+}
+
+// The fragment of h kept in the index. 0 marks a free slot, so it is never a
+// fragment.
+uint16_t
+BucketCloseTable::fragment(hashcode_t h)
+{
+    uint16_t f = uint16_t(h >> 48);
+    return f ? f : 1;
+}
+
+// Replace the buckets with capacity new, cache-line-aligned ones, the first
+// main of them empty and in use.
+void
+BucketCloseTable::allocate_buckets(size_t main, size_t capacity)
+{
+    delete[] bucket_memory;
+    bucket_memory = new char[capacity * sizeof(Bucket) + BucketAlign - 1];
+    uintptr_t p = reinterpret_cast<uintptr_t>(bucket_memory);
+    buckets = reinterpret_cast<Bucket *>((p + BucketAlign - 1) & ~uintptr_t(BucketAlign - 1));
+    buckets_capacity = capacity;
+    buckets_length = main;
+    for (size_t i = 0; i < main; i++) {
+        memset(buckets[i].fragments, 0, sizeof(buckets[i].fragments));
+        buckets[i].overflow = NoEntry;
+    }
+}
+
+// Return the slot that refers to key, as bucket * BucketSlots + slot, or
+// size_t(-1) if the key is not in the table.
+size_t
+BucketCloseTable::lookup(KeyArg key, hashcode_t h) const
+{
+    uint16_t f = fragment(h);
+    uint32_t b = uint32_t(h & table_mask);
+    do {
+        const Bucket &bucket = buckets[b];
+        for (unsigned bits = match_fragment(bucket.fragments, f) & 0x55555; bits; bits &= bits - 1) {
+            unsigned i = lowest_bit(bits) / 2;
+            if (entries[bucket.indexes[i]].key == key)
+                return b * size_t(BucketSlots) + i;
+        }
+        b = bucket.overflow;
+    } while (b != NoEntry);
+    return size_t(-1);
+}
+
+// Add entries[index], whose key has hash code h, to the index.
+void
+BucketCloseTable::insert(hashcode_t h, uint32_t index)
+{
+    uint16_t f = fragment(h);
+    uint32_t b = uint32_t(h & table_mask);
+    for (;;) {
+        Bucket &bucket = buckets[b];
+        unsigned bits = match_fragment(bucket.fragments, 0) & 0x55555;
+        if (bits) {
+            unsigned i = lowest_bit(bits) / 2;
+            bucket.fragments[i] = f;
+            bucket.indexes[i] = index;
+            return;
+        }
+        if (bucket.overflow == NoEntry)
+            break;
+        b = bucket.overflow;
+    }
+
+    // Every bucket in the list is full. Chain on an overflow bucket, growing
+    // the bucket array if necessary. Buckets refer to each other by index, so
+    // they can be copied as they are.
+    if (buckets_length == buckets_capacity) {
+        char *old_memory = bucket_memory;
+        Bucket *old_buckets = buckets;
+        size_t old_length = buckets_length;
+        bucket_memory = NULL;
+        allocate_buckets(0, buckets_capacity * 2);
+        memcpy(buckets, old_buckets, old_length * sizeof(Bucket));
+        buckets_length = old_length;
+        delete[] old_memory;
+    }
+    uint32_t nb = uint32_t(buckets_length++);
+    Bucket &bucket = buckets[nb];
+    memset(bucket.fragments, 0, sizeof(bucket.fragments));
+    bucket.fragments[0] = f;
+    bucket.indexes[0] = index;
+    bucket.overflow = NoEntry;
+    buckets[b].overflow = nb;
+}
+
+void
+BucketCloseTable::rehash(size_t new_table_mask)
+{
+    Entry *old_entries = entries;
+    Entry *old_end = entries + entries_length;
+
+    // Leave room for a few overflow buckets.
+    size_t n = new_table_mask + 1;
+    allocate_buckets(n, n + n / 8 + 1);
+    table_mask = new_table_mask;
+    entries_capacity = size_t(n * fill_factor());
+    entries = new Entry[entries_capacity];
+
+    Entry *q = entries;
+    for (Entry *p = old_entries; p != old_end; p++) {
+        if (!isEmpty(p->key)) {
+            insert(MixHash::hash(p->key), uint32_t(q - entries));
+            *q++ = *p;
+        }
+    }
+
+    delete[] old_entries;
+    entries_length = live_count;
+}
+
+size_t
+BucketCloseTable::byte_size(ByteSizeOption option) const
+{
+    return sizeof(*this)
+        + (option != BytesWritten
+           ? buckets_capacity * sizeof(Bucket) + BucketAlign - 1 + entries_capacity * sizeof(Entry)
+           : buckets_length * sizeof(Bucket) + entries_length * sizeof(Entry));
+}
+
+size_t
+BucketCloseTable::size() const
+{
+    return live_count;
+}
+
+bool
+BucketCloseTable::has(KeyArg key) const
+{
+    return lookup(key, MixHash::hash(key)) != size_t(-1);
+}
+
+Value
+BucketCloseTable::get(KeyArg key) const
+{
+    size_t s = lookup(key, MixHash::hash(key));
+    return s != size_t(-1) ? entries[buckets[s / BucketSlots].indexes[s % BucketSlots]].value : Value();
+}
+
+void
+BucketCloseTable::set(KeyArg key, ValueArg value)
+{
+    hashcode_t h = MixHash::hash(key);
+    size_t s = lookup(key, h);
+    if (s != size_t(-1)) {
+        entries[buckets[s / BucketSlots].indexes[s % BucketSlots]].value = value;
+        return;
+    }
+
+    if (entries_length == entries_capacity) {
+        // As in CloseTable::set.
+        rehash(live_count >= entries_capacity * 0.75
+               ? (table_mask << 1) | 1
+               : table_mask);
+    }
+    insert(h, uint32_t(entries_length));
+    Entry *e = &entries[entries_length++];
+    e->key = key;
+    e->value = value;
+    live_count++;
+}
+
+bool
+BucketCloseTable::remove(KeyArg key)
+{
+    size_t s = lookup(key, MixHash::hash(key));
+    if (s == size_t(-1))
+        return false;
+    Bucket &bucket = buckets[s / BucketSlots];
+    makeEmpty(entries[bucket.indexes[s % BucketSlots]].key);
+    bucket.fragments[s % BucketSlots] = 0;
+    live_count--;
+
+    // If many entries have been removed, shrink the table.
+    if (table_mask + 1 > initial_buckets() && live_count < entries_length * min_vector_fill())
+        rehash(table_mask >> 1);
+    return true;
+}
+
+
+// === InlineTable
+
+template <class Table, size_t N>
+InlineTable<Table, N>::InlineTable()
+{
+    inline_count = 0;
+    table = NULL;
+}
+
+template <class Table, size_t N>
+InlineTable<Table, N>::~InlineTable()
+{
+    delete table;
+}
+
+// Return the index of key in keys[0..inline_count), or N if it isn't there.
+// (A plain loop over a small fixed-size array; the compiler can unroll or
+// vectorize it.)
+template <class Table, size_t N>
+size_t
+InlineTable<Table, N>::find(KeyArg key) const
+{
+    for (size_t i = 0; i < inline_count; i++) {
+        if (keys[i] == key)
+            return i;
+    }
+    return N;
+}
+
+template <class Table, size_t N>
+size_t
+InlineTable<Table, N>::byte_size(ByteSizeOption option) const
+{
+    return sizeof(*this) + (table ? table->byte_size(option) : 0);
+}
+
+template <class Table, size_t N>
+size_t
+InlineTable<Table, N>::size() const
+{
+    return table ? table->size() : inline_count;
+}
+
+template <class Table, size_t N>
+bool
+InlineTable<Table, N>::has(KeyArg key) const
+{
+    return table ? table->has(key) : find(key) != N;
+}
+
+template <class Table, size_t N>
+Value
+InlineTable<Table, N>::get(KeyArg key) const
+{
+    if (table)
+        return table->get(key);
+    size_t i = find(key);
+    return i != N ? values[i] : Value();
+}
+
+template <class Table, size_t N>
+void
+InlineTable<Table, N>::set(KeyArg key, ValueArg value)
+{
+    if (table) {
+        table->set(key, value);
+        return;
+    }
+
+    size_t i = find(key);
+    if (i != N) {
+        values[i] = value;
+    } else if (inline_count < N) {
+        keys[inline_count] = key;
+        values[inline_count] = value;
+        inline_count++;
+    } else {
+        // Out of room. Move to the heap.
+        table = new Table;
+        for (i = 0; i < inline_count; i++)
+            table->set(keys[i], values[i]);
+        table->set(key, value);
+    }
+}
+
+template <class Table, size_t N>
+bool
+InlineTable<Table, N>::remove(KeyArg key)
+{
+    if (table)
+        return table->remove(key);
+
+    // Close the gap, to keep the rest in insertion order.
+    size_t i = find(key);
+    if (i == N)
+        return false;
+    inline_count--;
+    for (; i < inline_count; i++) {
+        keys[i] = keys[i + 1];
+        values[i] = values[i + 1];
+    }
+    return true;
+}
+
+template class InlineTable<OpenTable>;
+template class InlineTable<CloseTable>;
+
+
+// === CowTable
+
+template <class Table>
+CowTable<Table>::CowTable()
+{
+    shared = new Shared;
+}
+
+template <class Table>
+CowTable<Table>::CowTable(const CowTable &other)
+{
+    shared = other.shared;
+    shared->refs++;
+}
+
+template <class Table>
+CowTable<Table> &
+CowTable<Table>::operator=(const CowTable &other)
+{
+    other.shared->refs++;
+    release();
+    shared = other.shared;
+    return *this;
+}
+
+template <class Table>
+CowTable<Table>::~CowTable()
+{
+    release();
+}
+
+template <class Table>
+void
+CowTable<Table>::release()
+{
+    if (--shared->refs == 0)
+        delete shared;
+}
+
+// Get a Table that no other CowTable shares, copying the shared one if
+// necessary.
+template <class Table>
+Table &
+CowTable<Table>::unshare()
+{
+    if (shared->refs > 1) {
+        Shared *copy = new Shared(shared->table);
+        release();
+        shared = copy;
+    }
+    return shared->table;
+}
+
+template <class Table>
+bool
+CowTable<Table>::is_shared() const
+{
+    return shared->refs > 1;
+}
+
+// A shared Table is charged in equal parts to each CowTable that shares it,
+// so that the byte sizes of a table and all its snapshots add up to the
+// memory they use.
+template <class Table>
+size_t
+CowTable<Table>::byte_size(ByteSizeOption option) const
+{
+    size_t shared_size = sizeof(Shared) - sizeof(Table) + shared->table.byte_size(option);
+    return sizeof(*this) + shared_size / shared->refs;
+}
+
+template <class Table>
+size_t
+CowTable<Table>::size() const
+{
+    return shared->table.size();
+}
+
+template <class Table>
+bool
+CowTable<Table>::has(KeyArg key) const
+{
+    return shared->table.has(key);
+}
+
+template <class Table>
+Value
+CowTable<Table>::get(KeyArg key) const
+{
+    return shared->table.get(key);
+}
+
+template <class Table>
+void
+CowTable<Table>::set(KeyArg key, ValueArg value)
+{
+    unshare().set(key, value);
+}
+
+template <class Table>
+bool
+CowTable<Table>::remove(KeyArg key)
+{
+    // Removing a key that isn't there doesn't count as a write.
+    if (is_shared() && !shared->table.has(key))
+        return false;
+    return unshare().remove(key);
+}
+
+template class CowTable<OpenTable>;
+template class CowTable<CloseTable>;
+
+
+// === Traces
+
+static const char trace_magic[8] = { 'd', 'h', 't', 't', 'r', 'a', 'c', 'e' };
+
+bool
+TraceHeader::valid() const
+{
+    return memcmp(magic, trace_magic, sizeof(magic)) == 0
+        && version == Version
+        && record_size == sizeof(TraceRecord);
+}
+
+TraceWriter::TraceWriter()
+{
+    file = NULL;
+    count = 0;
+    table_count = 0;
+}
+
+TraceWriter::~TraceWriter()
+{
+    if (file)
+        close();
+}
+
+bool
+TraceWriter::write_header()
+{
+    TraceHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, trace_magic, sizeof(header.magic));
+    header.version = TraceHeader::Version;
+    header.record_size = sizeof(TraceRecord);
+    header.count = count;
+    header.table_count = table_count;
+    return fwrite(&header, sizeof(header), 1, file) == 1;
+}
+
+bool
+TraceWriter::open(const char *filename)
+{
+    if (file)
+        close();
+    file = fopen(filename, "wb");
+    if (!file)
+        return false;
+    count = 0;
+    table_count = 0;
+    // Write a placeholder header now; close() rewrites it.
+    return write_header();
+}
+
+bool
+TraceWriter::close()
+{
+    if (!file)
+        return false;
+    bool ok = !ferror(file) && fseek(file, 0, SEEK_SET) == 0 && write_header();
+    ok = fclose(file) == 0 && ok;
+    file = NULL;
+    return ok;
+}
+
+void
+TraceWriter::write(TraceOp op, uint32_t table, KeyArg key, ValueArg value)
+{
+    TraceRecord r;
+    memset(&r, 0, sizeof(r));
+    r.op = uint8_t(op);
+    r.table = table;
+    r.key = key;
+    r.value = value;
+    fwrite(&r, sizeof(r), 1, file);
+    count++;
+}
+
+template <class Table>
+TraceRecorder<Table>::TraceRecorder(TraceWriter &w)
+{
+    writer = &w;
+    id = w.new_table();
+}
+
+template <class Table>
+size_t
+TraceRecorder<Table>::byte_size(ByteSizeOption option) const
+{
+    return sizeof(*this) - sizeof(table) + table.byte_size(option);
+}
+
+template <class Table>
+size_t
+TraceRecorder<Table>::size() const
+{
+    return table.size();
+}
+
+template <class Table>
+bool
+TraceRecorder<Table>::has(KeyArg key) const
+{
+    bool result = table.has(key);
+    writer->write(TraceHas, id, key, result);
+    return result;
+}
+
+template <class Table>
+Value
+TraceRecorder<Table>::get(KeyArg key) const
+{
+    Value result = table.get(key);
+    writer->write(TraceGet, id, key, result);
+    return result;
+}
+
+template <class Table>
+void
+TraceRecorder<Table>::set(KeyArg key, ValueArg value)
+{
+    table.set(key, value);
+    writer->write(TraceSet, id, key, value);
+}
+
+template <class Table>
+bool
+TraceRecorder<Table>::remove(KeyArg key)
+{
+    bool result = table.remove(key);
+    writer->write(TraceRemove, id, key, result);
+    return result;
+}
+
+template class TraceRecorder<OpenTable>;
+template class TraceRecorder<CloseTable>;
+
+
+// === MappedCloseTable and MappedOpenTable
+
+#ifdef HAVE_MMAP
+
+namespace {
+
+// The header of a mapped table file. The arrays that follow it depend on the
+// kind of table; see tables.h.
+struct MappedHeader {
+    char magic[8];          // "dhtclose" or "dhtopen_"
+    uint32_t version;
+    uint32_t byte_order;    // MappedByteOrder, as written by the saving machine
+    uint64_t seed;          // MixHash::seed when saved
+    uint64_t count;         // number of entries
+    uint64_t mask;          // number of buckets (or slots), minus one
+};
+
+// Version 1 files were written when hash codes were 32 bits. Tables of fewer
+// than 2^29 buckets or slots probe exactly as they did then, so those files
+// can still be read.
+enum { MappedVersion = 2, MappedByteOrder = 0x01020304 };
+
+const char close_magic[8] = { 'd', 'h', 't', 'c', 'l', 'o', 's', 'e' };
+const char open_magic[8] = { 'd', 'h', 't', 'o', 'p', 'e', 'n', '_' };
+
+inline size_t
+align8(size_t n)
+{
+    return (n + 7) & ~size_t(7);
+}
+
+// Byte offsets of the arrays in a MappedCloseTable file.
+struct CloseLayout {
+    size_t buckets, keys, values, chains, end;
+
+    CloseLayout(uint64_t count, uint64_t mask) {
+        buckets = sizeof(MappedHeader);
+        keys = align8(buckets + (mask + 1) * sizeof(uint32_t));
+        values = keys + count * sizeof(Key);
+        chains = values + count * sizeof(Value);
+        end = chains + count * sizeof(uint32_t);
+    }
+};
+
+void
+init_header(MappedHeader &h, const char *magic, uint64_t count, uint64_t mask)
+{
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, magic, sizeof(h.magic));
+    h.version = MappedVersion;
+    h.byte_order = MappedByteOrder;
+    h.seed = MixHash::seed;
+    h.count = count;
+    h.mask = mask;
+}
+
+bool
+write_bytes(FILE *f, const void *p, size_t n)
+{
+    return n == 0 || fwrite(p, n, 1, f) == 1;
 }
 
-OpenTable::~OpenTable() {
-    delete[] table;
+bool
+finish_file(FILE *f, bool ok)
+{
+    ok = !ferror(f) && ok;
+    return fclose(f) == 0 && ok;
 }
 
-OpenTable::Entry *
-OpenTable::lookup(KeyArg key)
+// Map a whole file read-only. Return NULL on error.
+void *
+map_file(const char *filename, size_t *size)
 {
-    hashcode_t h = hash(key);
-    size_t i = h & mask;
-    h >>= 3;
-    while (!isEmpty(table[i].key)) {
-        if (table[i].key == key)
-            return &table[i];
-        i = (i + (h | 1)) & mask;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(MappedHeader)) {
+        *size = size_t(st.st_size);
+        p = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
     }
-    return NULL;
+    close(fd);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+// Check the parts of a header that every kind of file has.
+bool
+header_ok(const MappedHeader *h, const char *magic)
+{
+    return memcmp(h->magic, magic, sizeof(h->magic)) == 0
+        && (h->version == MappedVersion || (h->version == 1 && h->mask < (uint64_t(1) << 29)))
+        && h->byte_order == MappedByteOrder
+        && h->seed == MixHash::seed
+        && h->mask < uint64_t(size_t(-1))
+        && (h->mask & (h->mask + 1)) == 0;
+}
+
+}  // namespace
+
+MappedCloseTable::MappedCloseTable()
+{
+    map = NULL;
+    map_size = 0;
+    count = 0;
+    mask = 0;
+    table = NULL;
 }
 
-const OpenTable::Entry *
-OpenTable::lookup(KeyArg key) const
+MappedCloseTable::~MappedCloseTable()
 {
-    return const_cast<OpenTable *>(this)->lookup(key);
+    unmap();
+    delete table;
 }
 
 void
-OpenTable::rehash(size_t new_capacity)
+MappedCloseTable::unmap()
 {
-    Entry *old_table = table;
-    Entry *old_table_end = table + mask + 1;
-    table = new Entry[new_capacity];
-    mask = new_capacity - 1;
-    live_count = 0;
-    nonempty_count = 0;
-    for (Entry *p = old_table; p != old_table_end; ++p) {
-        if (isLive(p->key))
-            set(p->key, p->value);
+    if (map)
+        munmap(map, map_size);
+    map = NULL;
+    count = 0;
+}
+
+bool
+MappedCloseTable::save(const CloseTable &table, const char *filename)
+{
+    // Number the live entries in order, and chain them into buckets as
+    // CloseTable would for a table of this size.
+    uint64_t count = table.live_count;
+    if (count >= NoEntry)
+        return false;
+    size_t mask = CloseTable::buckets_for(count) - 1;
+    vector<uint32_t> buckets(mask + 1, uint32_t(NoEntry));
+    vector<Key> keys;
+    vector<Value> values;
+    vector<uint32_t> chains;
+    keys.reserve(count);
+    values.reserve(count);
+    chains.reserve(count);
+    for (size_t i = 0; i < table.entries_length; i++) {
+        const CloseTable::Entry &e = table.entries[i];
+        if (!isLive(e.key))
+            continue;
+        size_t b = MixHash::hash(e.key) & mask;
+        chains.push_back(buckets[b]);
+        buckets[b] = uint32_t(keys.size());
+        keys.push_back(e.key);
+        values.push_back(e.value);
     }
-    delete[] old_table;
+
+    FILE *f = fopen(filename, "wb");
+    if (!f)
+        return false;
+    MappedHeader header;
+    init_header(header, close_magic, count, mask);
+    CloseLayout layout(count, mask);
+    static const char padding[8] = { 0 };
+    bool ok = write_bytes(f, &header, sizeof(header))
+        && write_bytes(f, &buckets[0], buckets.size() * sizeof(uint32_t))
+        && write_bytes(f, padding, layout.keys - (layout.buckets + buckets.size() * sizeof(uint32_t)))
+        && (count == 0
+            || (write_bytes(f, &keys[0], count * sizeof(Key))
+                && write_bytes(f, &values[0], count * sizeof(Value))
+                && write_bytes(f, &chains[0], count * sizeof(uint32_t))));
+    return finish_file(f, ok);
+}
+
+bool
+MappedCloseTable::open(const char *filename)
+{
+    unmap();
+    delete table;
+    table = NULL;
+
+    map = map_file(filename, &map_size);
+    if (!map)
+        return false;
+    const MappedHeader *h = static_cast<const MappedHeader *>(map);
+    if (!header_ok(h, close_magic) || h->count >= NoEntry
+        || CloseLayout(h->count, h->mask).end != map_size) {
+        unmap();
+        return false;
+    }
+
+    const char *base = static_cast<const char *>(map);
+    CloseLayout layout(h->count, h->mask);
+    count = size_t(h->count);
+    mask = size_t(h->mask);
+    buckets = reinterpret_cast<const uint32_t *>(base + layout.buckets);
+    keys = reinterpret_cast<const Key *>(base + layout.keys);
+    values = reinterpret_cast<const Value *>(base + layout.values);
+    chains = reinterpret_cast<const uint32_t *>(base + layout.chains);
+    return true;
+}
+
+// Return the index of the entry for key in the mapped file, or NoEntry.
+//
+// open() doesn't read the bucket and chain arrays, so a corrupt file can
+// have any index in them. An index past the entries ends the chain, and so
+// does a chain longer than count, which must go around in a loop.
+uint32_t
+MappedCloseTable::lookup(KeyArg key) const
+{
+    if (!map)
+        return NoEntry;
+    uint32_t i = buckets[MixHash::hash(key) & mask];
+    for (size_t steps = 0; i < count && steps < count; steps++) {
+        if (keys[i] == key)
+            return i;
+        i = chains[i];
+    }
+    return NoEntry;
+}
+
+// Copy the mapped entries into a CloseTable of our own, in order, and drop
+// the mapping.
+void
+MappedCloseTable::unshare()
+{
+    table = new CloseTable;
+    if (map)
+        table->assign(keys, values, count);
+    unmap();
 }
 
 size_t
-OpenTable::byte_size(ByteSizeOption) const
+MappedCloseTable::byte_size(ByteSizeOption option) const
 {
-    return sizeof(*this) + (mask + 1) * sizeof(Entry);
+    return sizeof(*this) + (table ? table->byte_size(option) : map_size);
 }
 
 size_t
-OpenTable::size() const
+MappedCloseTable::size() const
 {
-    return live_count;
+    return table ? table->size() : count;
 }
 
 bool
-OpenTable::has(KeyArg key) const
+MappedCloseTable::has(KeyArg key) const
 {
-    return lookup(key) != NULL;
+    return table ? table->has(key) : lookup(key) != NoEntry;
 }
 
 Value
-OpenTable::get(KeyArg key) const
+MappedCloseTable::get(KeyArg key) const
 {
-    const Entry *e = lookup(key);
-    return e ? e->value : Value();
+    if (table)
+        return table->get(key);
+    uint32_t i = lookup(key);
+    return i == NoEntry ? Value() : values[i];
 }
 
 void
-OpenTable::set(KeyArg key, ValueArg value)
+MappedCloseTable::set(KeyArg key, ValueArg value)
 {
-    hashcode_t h = hash(key);
-    size_t i = h & mask;
-    h >>= 3;
-    while (isLive(table[i].key)) {
-        if (table[i].key == key) {
-            table[i].value = value;
-            return;
-        }
-        i = (i + (h | 1)) & mask;
+    if (!table)
+        unshare();
+    table->set(key, value);
+}
+
+bool
+MappedCloseTable::remove(KeyArg key)
+{
+    if (!table) {
+        if (lookup(key) == NoEntry)
+            return false;
+        unshare();
     }
+    return table->remove(key);
+}
 
-    bool tomb = isTombstone(table[i].key);
-    table[i].key = key;
-    table[i].value = value;
-    live_count++;
-    if (!tomb)
-        nonempty_count++;
-    if (nonempty_count > (mask + 1) * max_fill_ratio())
-        rehash((mask + 1) << 1);
+MappedOpenTable::MappedOpenTable()
+{
+    map = NULL;
+    map_size = 0;
+    count = 0;
+    mask = 0;
+    table = NULL;
+}
+
+MappedOpenTable::~MappedOpenTable()
+{
+    unmap();
+    delete table;
+}
+
+void
+MappedOpenTable::unmap()
+{
+    if (map)
+        munmap(map, map_size);
+    map = NULL;
+    count = 0;
 }
 
 bool
-OpenTable::remove(KeyArg key)
+MappedOpenTable::save(const OpenTable &table, const char *filename)
 {
-    Entry *e = lookup(key);
-    if (!e)
+    FILE *f = fopen(filename, "wb");
+    if (!f)
         return false;
-    makeTombstone(e->key);
-    live_count--;
-    if (mask > 7 && live_count < (mask + 1) * min_fill_ratio())
-        rehash((mask + 1) >> 1);
-    return true;
+    MappedHeader header;
+    init_header(header, open_magic, table.live_count, table.mask);
+    bool ok = write_bytes(f, &header, sizeof(header));
+    for (size_t i = 0; ok && i <= table.mask; i++) {
+        Slot slot;
+        slot.key = table.table[i].key;
+        slot.value = table.table[i].value;
+        ok = write_bytes(f, &slot, sizeof(slot));
+    }
+    return finish_file(f, ok);
 }
 
+bool
+MappedOpenTable::open(const char *filename)
+{
+    unmap();
+    delete table;
+    table = NULL;
 
-// === DenseTable
+    map = map_file(filename, &map_size);
+    if (!map)
+        return false;
+    const MappedHeader *h = static_cast<const MappedHeader *>(map);
 
-#ifdef HAVE_SPARSEHASH
+    // An OpenTable is never more than 3/4 full, so a file with more live
+    // slots than that is corrupt. (Tombstones aren't counted in the header;
+    // lookup guards against a file with no empty slots.)
+    if (!header_ok(h, open_magic) || h->count > h->mask - h->mask / 4
+        || sizeof(MappedHeader) + (h->mask + 1) * sizeof(Slot) != map_size) {
+        unmap();
+        return false;
+    }
+    count = size_t(h->count);
+    mask = size_t(h->mask);
+    slots = reinterpret_cast<const Slot *>(h + 1);
+    return true;
+}
 
-DenseTable::DenseTable()
+// The same probe sequence as OpenTable::lookup. The step is odd, so mask + 1
+// probes visit every slot; a corrupt file with no empty slots stops there
+// instead of probing forever.
+const MappedOpenTable::Slot *
+MappedOpenTable::lookup(KeyArg key) const
 {
-    Key k;
-    makeEmpty(k);
-    map.set_empty_key(k);
-    makeTombstone(k);
-    map.set_deleted_key(k);
+    if (!map)
+        return NULL;
+    hashcode_t h = MixHash::hash(key);
+    size_t i = h & mask;
+    h >>= 3;
+    for (size_t probes = 0; probes <= mask && !isEmpty(slots[i].key); probes++) {
+        if (slots[i].key == key)
+            return &slots[i];
+        i = (i + (h | 1)) & mask;
+    }
+    return NULL;
+}
+
+void
+MappedOpenTable::unshare()
+{
+    table = new OpenTable;
+    if (map) {
+        table->reserve(count);
+        for (size_t i = 0; i <= mask; i++) {
+            if (isLive(slots[i].key))
+                table->set(slots[i].key, slots[i].value);
+        }
+    }
+    unmap();
 }
 
 size_t
-DenseTable::byte_size(ByteSizeOption) const
+MappedOpenTable::byte_size(ByteSizeOption option) const
 {
-    return sizeof(*this) + sizeof(std::pair<const Key, Value>) * map.bucket_count();
+    return sizeof(*this) + (table ? table->byte_size(option) : map_size);
 }
 
 size_t
-DenseTable::size() const
+MappedOpenTable::size() const
 {
-    return map.size();
+    return table ? table->size() : count;
 }
 
 bool
-DenseTable::has(KeyArg key) const
+MappedOpenTable::has(KeyArg key) const
 {
-    return map.find(key) != map.end();
+    return table ? table->has(key) : lookup(key) != NULL;
 }
 
 Value
-DenseTable::get(KeyArg key) const
+MappedOpenTable::get(KeyArg key) const
 {
-    Map::const_iterator it = map.find(key);
-    return (it == map.end() ? Value() : it->second);
+    if (table)
+        return table->get(key);
+    const Slot *slot = lookup(key);
+    return slot ? slot->value : Value();
 }
 
 void
-DenseTable::set(KeyArg key, ValueArg value)
+MappedOpenTable::set(KeyArg key, ValueArg value)
 {
-    map[key] = value;
+    if (!table)
+        unshare();
+    table->set(key, value);
 }
 
 bool
-DenseTable::remove(KeyArg key)
+MappedOpenTable::remove(KeyArg key)
 {
-    Map::iterator it = map.find(key);
-    if (it == map.end())
-        return false;
-    map.erase(it);
-    size_t n = map.bucket_count();
-    if (n > 32 && map.size() <= n / 8)
-        map.resize(0);
-    return true;
+    if (!table) {
+        if (!lookup(key))
+            return false;
+        unshare();
+    }
+    return table->remove(key);
 }
 
-#endif  // HAVE_SPARSEHASH
+#endif  // HAVE_MMAP
 
 
-// === CloseTable
+// === ConcurrentCloseTable
+
+#ifdef HAVE_PTHREADS
+
+// Readers load chain links with acquire semantics, which pairs with the
+// writer's release store when it links in a new entry. Keys and values are
+// read and written atomically but with no ordering, since a reader that sees
+// a stale one just sees the table as of a moment earlier.
 
-CloseTable::CloseTable()
+ConcurrentCloseTable::ConcurrentCloseTable()
 {
-    size_t buckets = initial_buckets();
-    table = new EntryPtr[buckets];
-    memset(table, 0, buckets * sizeof(EntryPtr));
-    table_mask = buckets - 1;
-    entries_capacity = size_t(buckets * fill_factor());
-    entries = new Entry[entries_capacity];
+    storage = new_storage(initial_buckets() - 1);
     entries_length = 0;
     live_count = 0;
+    epoch = 1;
+    memset(readers, 0, sizeof(readers));
 }
 
-CloseTable::~CloseTable()
+ConcurrentCloseTable::~ConcurrentCloseTable()
 {
-    delete[] table;
-    delete[] entries;
+    delete_storage(storage);
+    for (size_t i = 0; i < retired.size(); i++)
+        delete_storage(retired[i].storage);
 }
 
-CloseTable::Entry *
-CloseTable::lookup(KeyArg key, hashcode_t h)
+ConcurrentCloseTable::Storage *
+ConcurrentCloseTable::new_storage(size_t table_mask)
 {
-    for (Entry *e = table[h & table_mask]; e; e = e->chain) {
-        if (e->key == key)
+    Storage *s = new Storage;
+    s->table = new EntryPtr[table_mask + 1];
+    memset(s->table, 0, (table_mask + 1) * sizeof(EntryPtr));
+    s->table_mask = table_mask;
+    s->entries_capacity = size_t((table_mask + 1) * fill_factor());
+    s->entries = new Entry[s->entries_capacity];
+    return s;
+}
+
+void
+ConcurrentCloseTable::delete_storage(Storage *s)
+{
+    delete[] s->table;
+    delete[] s->entries;
+    delete s;
+}
+
+ConcurrentCloseTable::Entry *
+ConcurrentCloseTable::lookup(const Storage *s, KeyArg key, hashcode_t h)
+{
+    for (Entry *e = __atomic_load_n(&s->table[h & s->table_mask], __ATOMIC_ACQUIRE);
+         e;
+         e = __atomic_load_n(&e->chain, __ATOMIC_ACQUIRE))
+    {
+        if (__atomic_load_n(&e->key, __ATOMIC_RELAXED) == key)
             return e;
     }
     return NULL;
 }
 
-const CloseTable::Entry *
-CloseTable::lookup(KeyArg key) const {
-    return const_cast<CloseTable *>(this)->lookup(key, hash(key));
-}
-
 void
-CloseTable::rehash(size_t new_table_mask)
+ConcurrentCloseTable::rehash(size_t new_table_mask)
 {
-    size_t new_capacity = size_t((new_table_mask + 1) * fill_factor());
-    EntryPtr *new_table = new EntryPtr[new_table_mask + 1];
-    memset(new_table, 0, (new_table_mask + 1) * sizeof(EntryPtr));
-    Entry *new_entries = new Entry[new_capacity];
-
-    Entry *q = new_entries;
-    for (Entry *p = entries, *end = entries + entries_length; p != end; p++) {
+    // Build the new arrays where no reader can see them yet.
+    Storage *s = new_storage(new_table_mask);
+    Entry *q = s->entries;
+    Storage *old = storage;
+    for (Entry *p = old->entries, *end = old->entries + entries_length; p != end; p++) {
         if (!isEmpty(p->key)) {
-            hashcode_t h = hash(p->key) & new_table_mask;
+            hashcode_t h = MixHash::hash(p->key) & new_table_mask;
             q->key = p->key;
             q->value = p->value;
-            q->chain = new_table[h];
-            new_table[h] = q;
+            q->chain = s->table[h];
+            s->table[h] = q;
             q++;
         }
     }
-
-    delete[] table;
-    delete[] entries;
-    table = new_table;
-    table_mask = new_table_mask;
-    entries = new_entries;
-    entries_capacity = new_capacity;
     entries_length = live_count;
+
+    // Publish them, then retire the old ones. A reader that has seen the new
+    // epoch is guaranteed to see the new storage too.
+    __atomic_store_n(&storage, s, __ATOMIC_SEQ_CST);
+    Retired r = { old, epoch };
+    retired.push_back(r);
+    __atomic_store_n(&epoch, epoch + 1, __ATOMIC_SEQ_CST);
+    reclaim();
+}
+
+// Free any retired storage that no reader is still using. A lookup that
+// started in epoch e may be using storage retired in epoch e or later.
+void
+ConcurrentCloseTable::reclaim()
+{
+    size_t oldest = size_t(-1);
+    for (size_t i = 0; i < MaxReaders; i++) {
+        size_t e = __atomic_load_n(&readers[i].epoch, __ATOMIC_SEQ_CST);
+        if (e != 0 && e < oldest)
+            oldest = e;
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < retired.size(); i++) {
+        if (retired[i].epoch < oldest)
+            delete_storage(retired[i].storage);
+        else
+            retired[kept++] = retired[i];
+    }
+    retired.resize(kept);
 }
 
 size_t
-CloseTable::byte_size(ByteSizeOption option) const
+ConcurrentCloseTable::byte_size(ByteSizeOption option) const
 {
-    return sizeof(*this)
-        + (table_mask + 1) * sizeof(EntryPtr)
-        + (option == BytesAllocated ? entries_capacity : entries_length) * sizeof(Entry);
+    size_t n = sizeof(*this)
+        + sizeof(Storage) + (storage->table_mask + 1) * sizeof(EntryPtr)
+        + (option != BytesWritten ? storage->entries_capacity : entries_length) * sizeof(Entry);
+    for (size_t i = 0; i < retired.size(); i++) {
+        const Storage *s = retired[i].storage;
+        n += sizeof(Storage) + (s->table_mask + 1) * sizeof(EntryPtr)
+            + s->entries_capacity * sizeof(Entry);
+    }
+    return n;
 }
 
 size_t
-CloseTable::size() const
+ConcurrentCloseTable::size() const
 {
     return live_count;
 }
 
 bool
-CloseTable::has(KeyArg key) const
+ConcurrentCloseTable::has(KeyArg key) const
 {
-    return lookup(key) != NULL;
+    return lookup(storage, key, MixHash::hash(key)) != NULL;
 }
 
 Value
-CloseTable::get(KeyArg key) const
+ConcurrentCloseTable::get(KeyArg key) const
 {
-    const Entry *e = lookup(key);
+    const Entry *e = lookup(storage, key, MixHash::hash(key));
     return e ? e->value : Value();
 }
 
 void
-CloseTable::set(KeyArg key, ValueArg value)
+ConcurrentCloseTable::set(KeyArg key, ValueArg value)
 {
-    hashcode_t h = hash(key);
-    Entry *e = lookup(key, h);
+    if (!retired.empty())
+        reclaim();
+
+    hashcode_t h = MixHash::hash(key);
+    Entry *e = lookup(storage, key, h);
     if (e) {
-        e->value = value;
+        __atomic_store_n(&e->value, value, __ATOMIC_RELAXED);
     } else {
-        if (entries_length == entries_capacity) {
-            // If the table is more than 1/4 deleted entries, simply rehash in
-            // place to free up some space. Otherwise, grow the table.
-            rehash(live_count >= entries_capacity * 0.75
-                   ? (table_mask << 1) | 1
-                   : table_mask);
+        if (entries_length == storage->entries_capacity) {
+            // As in CloseTable::set.
+            rehash(live_count >= storage->entries_capacity * 0.75
+                   ? (storage->table_mask << 1) | 1
+                   : storage->table_mask);
         }
-        h &= table_mask;
+        Storage *s = storage;
+        h &= s->table_mask;
         live_count++;
-        e = &entries[entries_length++];
+        e = &s->entries[entries_length++];
         e->key = key;
         e->value = value;
-        e->chain = table[h];
-        table[h] = e;
+        e->chain = s->table[h];
+        __atomic_store_n(&s->table[h], e, __ATOMIC_RELEASE);
     }
 }
 
 bool
-CloseTable::remove(KeyArg key)
+ConcurrentCloseTable::remove(KeyArg key)
 {
-    // If an entry exists for the given key, empty it.
-    Entry *e = lookup(key, hash(key));
+    Entry *e = lookup(storage, key, MixHash::hash(key));
     if (e == NULL)
         return false;
     live_count--;
-    makeEmpty(e->key);
+    __atomic_store_n(&e->key, Key(0), __ATOMIC_RELAXED);
 
     // If many entries have been removed, shrink the table.
-    if (table_mask > initial_buckets() && live_count < entries_length * min_vector_fill())
-        rehash(table_mask >> 1);
+    if (storage->table_mask > initial_buckets() && live_count < entries_length * min_vector_fill())
+        rehash(storage->table_mask >> 1);
     return true;
 }
+
+ConcurrentCloseTable::Reader::Reader(ConcurrentCloseTable &table)
+  : table(table)
+{
+    for (size_t i = 0; i < MaxReaders; i++) {
+        if (__sync_bool_compare_and_swap(&table.readers[i].in_use, 0, 1)) {
+            slot = &table.readers[i];
+            return;
+        }
+    }
+    abort();  // too many readers
+}
+
+ConcurrentCloseTable::Reader::~Reader()
+{
+    __atomic_store_n(&slot->in_use, 0, __ATOMIC_RELEASE);
+}
+
+Value
+ConcurrentCloseTable::Reader::get(KeyArg key)
+{
+    // Announce the epoch before loading the storage pointer; see rehash.
+    __atomic_store_n(&slot->epoch, __atomic_load_n(&table.epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+    const Storage *s = __atomic_load_n(&table.storage, __ATOMIC_SEQ_CST);
+    const Entry *e = lookup(s, key, MixHash::hash(key));
+    Value v = e ? __atomic_load_n(&e->value, __ATOMIC_RELAXED) : Value();
+    __atomic_store_n(&slot->epoch, 0, __ATOMIC_RELEASE);
+    return v;
+}
+
+bool
+ConcurrentCloseTable::Reader::has(KeyArg key)
+{
+    __atomic_store_n(&slot->epoch, __atomic_load_n(&table.epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+    const Storage *s = __atomic_load_n(&table.storage, __ATOMIC_SEQ_CST);
+    bool found = lookup(s, key, MixHash::hash(key)) != NULL;
+    __atomic_store_n(&slot->epoch, 0, __ATOMIC_RELEASE);
+    return found;
+}
+
+
+// === ShardedTable
+
+template <class Table, int ShardBits>
+ShardedTable<Table, ShardBits>::ShardedTable()
+{
+    shards = new Shard[NumShards];
+    for (size_t i = 0; i < NumShards; i++)
+        pthread_mutex_init(&shards[i].lock, NULL);
+}
+
+template <class Table, int ShardBits>
+ShardedTable<Table, ShardBits>::~ShardedTable()
+{
+    for (size_t i = 0; i < NumShards; i++)
+        pthread_mutex_destroy(&shards[i].lock);
+    delete[] shards;
+}
+
+template <class Table, int ShardBits>
+typename ShardedTable<Table, ShardBits>::Shard &
+ShardedTable<Table, ShardBits>::shard_for(Shard *shards, KeyArg key)
+{
+    // Take the top ShardBits bits. (Shift in two steps so that ShardBits == 0
+    // doesn't shift by the full width of the type.)
+    return shards[(MixHash::hash(key) >> 1) >> (8 * sizeof(hashcode_t) - 1 - ShardBits)];
+}
+
+template <class Table, int ShardBits>
+size_t
+ShardedTable<Table, ShardBits>::byte_size(ByteSizeOption option) const
+{
+    size_t n = sizeof(*this) + NumShards * (sizeof(Shard) - sizeof(Table));
+    for (size_t i = 0; i < NumShards; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+        n += shards[i].table.byte_size(option);
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+    return n;
+}
+
+template <class Table, int ShardBits>
+size_t
+ShardedTable<Table, ShardBits>::size() const
+{
+    size_t n = 0;
+    for (size_t i = 0; i < NumShards; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+        n += shards[i].table.size();
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+    return n;
+}
+
+template <class Table, int ShardBits>
+bool
+ShardedTable<Table, ShardBits>::has(KeyArg key) const
+{
+    Shard &s = shard_for(shards, key);
+    pthread_mutex_lock(&s.lock);
+    bool found = s.table.has(key);
+    pthread_mutex_unlock(&s.lock);
+    return found;
+}
+
+template <class Table, int ShardBits>
+Value
+ShardedTable<Table, ShardBits>::get(KeyArg key) const
+{
+    Shard &s = shard_for(shards, key);
+    pthread_mutex_lock(&s.lock);
+    Value v = s.table.get(key);
+    pthread_mutex_unlock(&s.lock);
+    return v;
+}
+
+template <class Table, int ShardBits>
+void
+ShardedTable<Table, ShardBits>::set(KeyArg key, ValueArg value)
+{
+    Shard &s = shard_for(shards, key);
+    pthread_mutex_lock(&s.lock);
+    s.table.set(key, value);
+    pthread_mutex_unlock(&s.lock);
+}
+
+template <class Table, int ShardBits>
+bool
+ShardedTable<Table, ShardBits>::remove(KeyArg key)
+{
+    Shard &s = shard_for(shards, key);
+    pthread_mutex_lock(&s.lock);
+    bool removed = s.table.remove(key);
+    pthread_mutex_unlock(&s.lock);
+    return removed;
+}
+
+template class ShardedTable<OpenTable>;
+template class ShardedTable<CloseTable>;
+template class ShardedTable<CloseTable, 0>;
+
+#endif  // HAVE_PTHREADS
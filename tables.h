@@ -2,10 +2,17 @@
 #define tables_h_
 
 #include <stdint.h>
+#include <cstdio>
 #include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
 #ifdef HAVE_SPARSEHASH
 #include <sparsehash/dense_hash_map>
 #endif
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
 
 // === Keys and values (common definitions used by both hash table implementations)
 
@@ -17,7 +24,7 @@ typedef uint64_t Key;
 typedef Key KeyArg;
 typedef uint64_t Value;
 typedef Value ValueArg;
-typedef uint32_t hashcode_t;
+typedef uint64_t hashcode_t;
 
 inline hashcode_t hash(KeyArg k) { return k; }
 
@@ -33,7 +40,323 @@ inline bool isTombstone(KeyArg k) { return k == Key(-1); }
 inline void makeTombstone(Key &k) { k = Key(-1); }
 inline bool isLive(KeyArg k) { return ((k + 1) & ~1) != 0; }
 
-enum ByteSizeOption { BytesAllocated, BytesWritten };
+// What byte_size counts. BytesPeak is the most the table has ever had
+// allocated at once, counting the moment during a rehash when the old and
+// new arrays are both allocated. Only CloseTable keeps track of that; the
+// other tables report BytesAllocated.
+enum ByteSizeOption { BytesAllocated, BytesWritten, BytesPeak };
+
+
+// === Hash policies
+// OpenTable and CloseTable take their hash function as a template parameter,
+// a class with a static member function
+//     static hashcode_t hash(KeyArg k);
+// The free function hash() above is the identity; only DenseTable uses it.
+// The other tables that don't take a policy call MixHash (or, for
+// SwissCloseTable, FibonacciHash) directly. Tables with other key types first
+// reduce each key to 64 bits using KeyTraits::bits (see below), then apply
+// the policy.
+//
+// Hash codes are 64 bits. The tables take the bucket index from the low bits
+// and OpenTable takes its probe step from the bits above those, so a table of
+// more than 2^32 buckets needs every one of them.
+
+// hash() itself. Free, but sequential or strided keys cluster badly.
+struct IdentityHash {
+    static hashcode_t hash(KeyArg k) { return hashcode_t(k); }
+};
+
+// Fibonacci hashing: multiply by 2^64/phi. This is one multiply, and it
+// spreads out strided keys. The high bits of the product are the well-mixed
+// ones, so rotate them down to where the tables look first.
+struct FibonacciHash {
+    static hashcode_t hash(KeyArg k) {
+        uint64_t x = uint64_t(k) * 0x9E3779B97F4A7C15ULL;
+        return (x >> 32) | (x << 32);
+    }
+};
+
+// The 64-bit finalizer from MurmurHash3, applied to the key xor a seed.
+// Every bit of the key affects every bit of the result. Change the seed
+// before creating any tables that use this policy, not after.
+struct MixHash {
+    static uint64_t seed;
+
+    static hashcode_t hash(KeyArg k) {
+        uint64_t x = uint64_t(k) ^ seed;
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdULL;
+        x ^= x >> 33;
+        x *= 0xc4ceb9fe1a85ec53ULL;
+        x ^= x >> 33;
+        return x;
+    }
+};
+
+
+// === Key traits
+// BasicOpenTable and BasicCloseTable are templates on the key and value
+// types. A key traits class tells them how to hash and compare keys and which
+// two key values mark empty entries and tombstones:
+//
+//     typedef ... KeyArg;                      // how keys are passed
+//     static uint64_t bits(KeyArg k);          // input to the hash policy
+//     static bool equal(const Key &a, KeyArg b);
+//     static bool isEmpty(const Key &k);       // and makeEmpty,
+//     static bool isLive(const Key &k);        // isTombstone, makeTombstone
+//
+// Keys and values of type uint64_t are passed by value; anything else, by
+// const reference.
+
+template <class T> struct ArgType { typedef const T &type; };
+template <> struct ArgType<uint64_t> { typedef uint64_t type; };
+
+template <class K> struct KeyTraits;
+
+// The default: 64-bit integer keys, with the sentinels described at the top
+// of this file. This compiles to exactly the code the tables had before they
+// were templates.
+template <> struct KeyTraits<uint64_t> {
+    typedef uint64_t KeyArg;
+    static uint64_t bits(KeyArg k) { return k; }
+    static bool equal(KeyArg a, KeyArg b) { return a == b; }
+    static bool isEmpty(KeyArg k) { return ::isEmpty(k); }
+    static void makeEmpty(uint64_t &k) { ::makeEmpty(k); }
+    static bool isTombstone(KeyArg k) { return ::isTombstone(k); }
+    static void makeTombstone(uint64_t &k) { ::makeTombstone(k); }
+    static bool isLive(KeyArg k) { return ::isLive(k); }
+};
+
+// 64-bit keys in which 0 is an ordinary value, such as NaN-boxed JS values.
+// The sentinels are the two largest 64-bit values, which are NaNs with a
+// payload that no NaN-boxing scheme produces.
+struct BoxedKeyTraits {
+    typedef uint64_t KeyArg;
+    static uint64_t bits(KeyArg k) { return k; }
+    static bool equal(KeyArg a, KeyArg b) { return a == b; }
+    static bool isEmpty(KeyArg k) { return k == uint64_t(-1); }
+    static void makeEmpty(uint64_t &k) { k = uint64_t(-1); }
+    static bool isTombstone(KeyArg k) { return k == uint64_t(-2); }
+    static void makeTombstone(uint64_t &k) { k = uint64_t(-2); }
+    static bool isLive(KeyArg k) { return k < uint64_t(-2); }
+};
+
+// A string key. The 64-bit hash of the bytes is computed once, when the key
+// is made, and stored in the table along with the string; so comparing keys
+// usually only compares the hashes, and rehashing never reads the bytes.
+struct StringKey {
+    std::string chars;
+    uint64_t bits;      // hash of chars; 0 and 1 are reserved as sentinels
+
+    StringKey() : bits(0) {}
+    explicit StringKey(const std::string &s) : chars(s), bits(hash_bytes(s.data(), s.size())) {}
+    explicit StringKey(const char *s) : chars(s), bits(hash_bytes(chars.data(), chars.size())) {}
+
+    // FNV-1a, adjusted so that the result is never 0 or 1.
+    static uint64_t hash_bytes(const char *p, size_t n) {
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (size_t i = 0; i < n; i++)
+            h = (h ^ uint8_t(p[i])) * 0x100000001b3ULL;
+        return h < 2 ? h + 2 : h;
+    }
+};
+
+template <> struct KeyTraits<StringKey> {
+    typedef const StringKey &KeyArg;
+    static uint64_t bits(KeyArg k) { return k.bits; }
+    static bool equal(KeyArg a, KeyArg b) { return a.bits == b.bits && a.chars == b.chars; }
+    static bool isEmpty(KeyArg k) { return k.bits == 0; }
+    static void makeEmpty(StringKey &k) { k.chars.clear(); k.bits = 0; }
+    static bool isTombstone(KeyArg k) { return k.bits == 1; }
+    static void makeTombstone(StringKey &k) { k.chars.clear(); k.bits = 1; }
+    static bool isLive(KeyArg k) { return k.bits > 1; }
+};
+
+
+// === Sets
+// BasicOpenTable and BasicCloseTable with V = void are sets: each entry holds
+// a key and nothing else. OpenSet and CloseSet are the versions with integer
+// keys. A set acts like a map to bool in which missing keys map to false, so
+// get(key) is the same as has(key), set(key, true) adds key, and
+// set(key, false) removes it.
+//
+// The tables store the key and value of an entry in a KeyValue, and touch the
+// value only through it. KeyValue<K, void> has no value member, so an
+// OpenSet slot is 8 bytes instead of 16 and a CloseSet entry 16 instead of 24.
+
+template <class K, class V>
+struct KeyValue {
+    typedef V Value;
+    typedef typename ArgType<V>::type ValueArg;
+
+    K key;
+    V value;
+
+    const V &get_value() const { return value; }
+    void set_value(ValueArg v) { value = v; }
+
+    // False if setting a key to v should remove it instead.
+    static bool present(ValueArg) { return true; }
+};
+
+template <class K>
+struct KeyValue<K, void> {
+    typedef bool Value;
+    typedef bool ValueArg;
+
+    K key;
+
+    bool get_value() const { return true; }
+    void set_value(bool) {}
+    static bool present(bool v) { return v; }
+};
+
+
+// === Allocators
+// BasicOpenTable and BasicCloseTable get their arrays from an allocator
+// policy, a class with these static member functions:
+//     static void *allocate(size_t nbytes);
+//     static void deallocate(void *p, size_t nbytes);
+//     static bool can_reallocate(size_t old_nbytes, size_t new_nbytes);
+//     static void *reallocate(void *p, size_t old_nbytes, size_t new_nbytes);
+// A table always passes deallocate the size it asked allocate for.
+// reallocate resizes a block without copying it byte by byte, like mremap;
+// the block may move. A table calls it only if can_reallocate says yes.
+// The policies below get their memory from ::operator new in the end, which
+// is where hashbench counts allocations, except for HugePageAllocator's big
+// blocks.
+
+// Plain operator new and delete. The default.
+struct HeapAllocator {
+    static void *allocate(size_t nbytes) { return ::operator new(nbytes); }
+    static void deallocate(void *p, size_t) { ::operator delete(p); }
+    static bool can_reallocate(size_t, size_t) { return false; }
+    static void *reallocate(void *, size_t, size_t) { return NULL; }
+};
+
+// Recycles freed blocks. Each thread has a free list for each power-of-two
+// size class up to 2^MaxClassBits bytes; a freed block goes on the list for
+// its class (of the thread freeing it), and the next allocation of that class
+// takes it back off. This pays off when tables are created and destroyed over
+// and over, as in InsertSmallTest. Bigger blocks, and blocks that would make
+// a list longer than MaxCachedBlocks, go straight back to the heap.
+struct PoolAllocator {
+    enum { MinClassBits = 4, MaxClassBits = 16, MaxCachedBlocks = 64 };
+
+    static void *allocate(size_t nbytes);
+    static void deallocate(void *p, size_t nbytes);
+    static bool can_reallocate(size_t, size_t) { return false; }
+    static void *reallocate(void *, size_t, size_t) { return NULL; }
+};
+
+// A bump-pointer arena, for a batch of short-lived tables. Memory is handed
+// out from big chunks and never freed one block at a time; instead release()
+// frees everything the arena has handed out, all at once:
+//
+//     Arena arena;
+//     Arena::Scope scope(arena);   // tables allocate from arena from here on
+//     for (...) {
+//         {
+//             ArenaCloseTable a, b, c;
+//             ...
+//         }                        // destroying them frees nothing
+//         arena.release();
+//     }
+//
+// release() keeps the chunks to hand out again; ~Arena returns them to the
+// heap. Don't use a table after releasing the arena it allocated from. An
+// Arena, and the current Scope, are for one thread only.
+class Arena {
+private:
+    struct Chunk {
+        Chunk *next;
+        size_t size;    // bytes usable after the header
+    };
+
+    enum { ChunkBytes = 64 * 1024, Align = 16 };
+
+    Chunk *chunks;          // every ChunkBytes chunk, in order
+    Chunk *current_chunk;   // the one we are bumping through
+    char *next;             // next free byte in current_chunk
+    char *limit;            // end of current_chunk
+    Chunk *large;           // blocks too big to share a chunk, freed by release()
+
+    static Arena *current_arena;
+
+    static char *chunk_start(Chunk *c) { return reinterpret_cast<char *>(c) + Align; }
+    void start_chunk(Chunk *c);
+
+    Arena(const Arena &);
+    Arena &operator=(const Arena &);
+
+public:
+    Arena();
+    ~Arena();
+
+    void *allocate(size_t nbytes);
+    void release();
+
+    // Makes an arena the one ArenaAllocator uses, for the Scope's lifetime.
+    class Scope {
+    private:
+        Arena *saved;
+        Scope(const Scope &);
+        Scope &operator=(const Scope &);
+    public:
+        explicit Scope(Arena &arena) : saved(current_arena) { current_arena = &arena; }
+        ~Scope() { current_arena = saved; }
+    };
+
+    static Arena *current() { return current_arena; }
+};
+
+// Allocates from the innermost Arena::Scope's arena. deallocate does nothing.
+struct ArenaAllocator {
+    static void *allocate(size_t nbytes) { return Arena::current()->allocate(nbytes); }
+    static void deallocate(void *, size_t) {}
+    static bool can_reallocate(size_t, size_t) { return false; }
+    static void *reallocate(void *, size_t, size_t) { return NULL; }
+};
+
+#ifdef HAVE_MMAP
+// Gives each block of HugeBytes or more a mapping of its own, aligned to
+// HugeBytes, and asks the kernel to back it with transparent huge pages
+// (madvise MADV_HUGEPAGE, where there is such a thing). A table of a billion
+// entries spans hundreds of thousands of 4K pages, far more than the TLB
+// holds, so with small pages nearly every lookup misses in the TLB too.
+// Smaller blocks come from operator new.
+//
+// On Linux, a big block can grow or shrink with mremap, which moves pages
+// instead of copying them. A block that can't grow where it is moves to a
+// fresh range aligned to HugeBytes, so it keeps its huge pages. Since that
+// moves the bytes as they are, use this policy only with keys and values that
+// can be moved with memcpy.
+struct HugePageAllocator {
+    enum { HugeBytes = 2 * 1024 * 1024 };
+
+    static void *allocate(size_t nbytes);
+    static void deallocate(void *p, size_t nbytes);
+    static bool can_reallocate(size_t old_nbytes, size_t new_nbytes);
+    static void *reallocate(void *p, size_t old_nbytes, size_t new_nbytes);
+};
+#endif
+
+
+#ifdef HAVE_PTHREADS
+// === Parallel rehash
+// OpenTable and CloseTable rehash a table with at least threshold entries on
+// several threads at once. threads is how many; 0, the default, means one per
+// online CPU, and 1 turns parallel rehashing off. Set these before creating
+// any tables, not while tables are being used on other threads.
+//
+// A CloseTable rehashes in parallel with any key type. An OpenTable needs to
+// claim slots with an atomic compare-and-swap, so only OpenTables with plain
+// 64-bit keys do.
+struct ParallelRehash {
+    static size_t threshold;    // default 2^22
+    static unsigned threads;
+};
+#endif
 
 
 #ifdef HAVE_SPARSEHASH
@@ -62,16 +385,100 @@ public:
 #endif  // HAVE_SPARSEHASH
 
 
+#ifdef TABLE_STATS
+// === Table statistics
+// Built with -DTABLE_STATS, OpenTable and CloseTable count how their lookups
+// go and how often they rehash, and stats() reports that along with a census
+// of the table as it is now. Without TABLE_STATS there is no stats(), and
+// nothing is counted or stored.
+//
+// Counting writes to the table even in get and has, so a table built this
+// way must not be read on several threads at once.
+
+// What a table counts as it goes, from when it was created.
+struct TableCounters {
+    // Lookups by get, has, get_many and has_many that found the key, and
+    // that didn't. (set and remove aren't counted.) A probe is one slot of
+    // an OpenTable looked at, including the empty slot that ends a miss, or
+    // one entry on a CloseTable chain.
+    uint64_t hits, hit_probes;
+    uint64_t misses, miss_probes;
+
+    // Rehashes to more buckets, to fewer, and to the same number (to clear
+    // out tombstones or removed entries), and the time spent in all three.
+    uint64_t grows, shrinks, purges;
+    double rehash_seconds;
+
+    TableCounters()
+      : hits(0), hit_probes(0), misses(0), miss_probes(0),
+        grows(0), shrinks(0), purges(0), rehash_seconds(0) {}
+
+    void count_lookup(bool hit, size_t probes) {
+        if (hit) {
+            hits++;
+            hit_probes += probes;
+        } else {
+            misses++;
+            miss_probes += probes;
+        }
+    }
+
+    void count_rehash(size_t old_buckets, size_t new_buckets, double seconds) {
+        if (new_buckets > old_buckets)
+            grows++;
+        else if (new_buckets < old_buckets)
+            shrinks++;
+        else
+            purges++;
+        rehash_seconds += seconds;
+    }
+
+    double probes_per_hit() const { return hits ? double(hit_probes) / hits : 0; }
+    double probes_per_miss() const { return misses ? double(miss_probes) / misses : 0; }
+};
+
+struct TableStats : TableCounters {
+    enum { HistogramSize = 16 };
+
+    size_t live;        // live entries
+    size_t buckets;     // slots in an OpenTable, buckets in a CloseTable
+
+    // The fraction of an OpenTable's slots that are tombstones, or of a
+    // CloseTable's entries vector (the part in use) that is removed entries.
+    double dead_fraction;
+
+    // For an OpenTable, histogram[i] is the number of live keys found on
+    // probe i + 1; for a CloseTable, the number of buckets whose chain has i
+    // entries, counting removed entries not yet rehashed away. The last
+    // element also counts everything past it.
+    size_t histogram[HistogramSize];
+};
+#endif
+
+
 // === OpenTable
 // A simple hash table with open addressing.
 // See <https://en.wikipedia.org/wiki/Hash_table#Open_addressing>.
 //
-class OpenTable {
-    struct Entry {
-        Key key;
-        Value value;
+// BasicOpenTable is instantiated in tables.cpp for integer keys with each of
+// the hash policies above, for BoxedKeyTraits, for StringKey, and with
+// PoolAllocator and ArenaAllocator. OpenTable is the version with integer keys
+// and values, MixHash and HeapAllocator.
+//
+template <class K, class V, class HashPolicy = MixHash, class Traits = KeyTraits<K>,
+          class Alloc = HeapAllocator>
+class BasicOpenTable {
+public:
+    typedef K Key;
+    typedef typename Traits::KeyArg KeyArg;
+    typedef typename KeyValue<K, V>::Value Value;
+    typedef typename KeyValue<K, V>::ValueArg ValueArg;
+
+private:
+    friend class MappedOpenTable;
 
-        Entry() { makeEmpty(key); }
+    struct Entry : KeyValue<K, V> {
+        Entry() { Traits::makeEmpty(this->key); }
     };
 
     Entry *table;           // power-of-2-sized flat hash table
@@ -82,14 +489,120 @@ class OpenTable {
     static double min_fill_ratio() { return 0.25; }
     static double max_fill_ratio() { return 0.75; }
 
-    inline Entry * lookup(KeyArg key);
+    // get_many and has_many look keys up in groups of this many.
+    enum { BatchSize = 16 };
+
+    static hashcode_t hash_key(KeyArg key) { return HashPolicy::hash(Traits::bits(key)); }
+    inline Entry * lookup(KeyArg key, hashcode_t h);
     inline const Entry * lookup(KeyArg key) const;
+    inline void lookup_batch(const Key *keys, size_t n, const Entry **found) const;
+#ifdef TABLE_STATS
+    mutable TableCounters counters;
+    inline const Entry * counted_lookup(KeyArg key, hashcode_t h) const;
+#endif
+
+    void rehash(size_t new_capacity);
+    static size_t capacity_for(size_t n);
+#ifdef HAVE_PTHREADS
+    struct RehashJob;
+#endif
+
+public:
+    BasicOpenTable();
+    ~BasicOpenTable();
+
+    // Copy a table. This copies the slots as they are, tombstones and all,
+    // in one pass, without hashing anything.
+    BasicOpenTable(const BasicOpenTable &other);
+    BasicOpenTable &operator=(const BasicOpenTable &other);
+
+    size_t byte_size(ByteSizeOption option) const;
+    size_t size() const;
+    bool has(KeyArg key) const;
+    Value get(KeyArg key) const;
+    void set(KeyArg key, ValueArg value);
+    bool remove(KeyArg key);
+
+    // Look up n keys at once. This is the same as calling get (or has) n
+    // times, but the keys are hashed and their slots prefetched a group at a
+    // time, so the cache misses overlap instead of happening one by one.
+    void get_many(const Key *keys, Value *values, size_t n) const;
+    void has_many(const Key *keys, bool *results, size_t n) const;
+
+    // Make room for n entries in all, so that the next n - size() sets of
+    // new keys don't rehash. This never shrinks the table.
+    void reserve(size_t n);
+
+    // Shrink the table to the smallest size that holds its live entries, and
+    // clear out tombstones.
+    void shrink_to_fit();
+
+    // Replace the contents of the table with keys[0..n) and values[0..n),
+    // as if by clearing it and then setting each key in turn, but rehashing
+    // only once, up front.
+    void assign(const Key *keys, const Value *values, size_t n);
+
+#ifdef TABLE_STATS
+    // See "Table statistics" above. This walks the whole table.
+    TableStats stats() const;
+#endif
+
+    // Call f(key, value) for each entry, in no particular order, and return
+    // f. f must not modify the table.
+    template <class F>
+    F for_each(F f) const {
+        for (const Entry *p = table, *end = table + mask + 1; p != end; ++p) {
+            if (Traits::isLive(p->key))
+                f(p->key, p->get_value());
+        }
+        return f;
+    }
+};
+
+typedef BasicOpenTable<Key, Value> OpenTable;
+typedef BasicOpenTable<Key, void> OpenSet;
+typedef BasicOpenTable<Key, Value, MixHash, KeyTraits<Key>, PoolAllocator> PoolOpenTable;
+typedef BasicOpenTable<Key, Value, MixHash, KeyTraits<Key>, ArenaAllocator> ArenaOpenTable;
+#ifdef HAVE_MMAP
+typedef BasicOpenTable<Key, Value, MixHash, KeyTraits<Key>, HugePageAllocator> HugeOpenTable;
+#endif
+
+
+// === RobinHoodTable
+// Open addressing with linear probing and Robin Hood insertion: an entry
+// that is further from its home bucket displaces one that is closer. Each
+// slot's distance from home is kept in a byte array alongside the table.
+// Because the distances along a probe sequence never drop by more than one,
+// a lookup can stop as soon as it sees a slot whose entry is closer to home
+// than the key being sought would be. Removal shifts the following entries
+// back one slot instead of leaving a tombstone.
+// See <https://en.wikipedia.org/wiki/Hash_table#Robin_Hood_hashing>.
+//
+class RobinHoodTable {
+    struct Entry {
+        Key key;
+        Value value;
+    };
+
+    Entry *table;           // power-of-2-sized flat hash table
+    uint8_t *distances;     // for each slot, 0 if empty, else 1 + distance from home
+    size_t live_count;      // number of live entries
+    size_t mask;            // size of table, in elements, minus 1
+
+    static double min_fill_ratio() { return 0.25; }
+    static double max_fill_ratio() { return 0.875; }
 
+    // Probe distances are stored in a byte, so an entry may be at most
+    // max_distance() - 1 slots from home. Past that, the table grows.
+    static unsigned max_distance() { return 255; }
+
+    inline size_t lookup(KeyArg key) const;
+    inline bool insert(Entry &e);
     void rehash(size_t new_capacity);
 
 public:
-    OpenTable();
-    ~OpenTable();
+    RobinHoodTable();
+    ~RobinHoodTable();
 
     size_t byte_size(ByteSizeOption option) const;
     size_t size() const;
@@ -104,8 +617,21 @@ public:
 // A vector combined with a very simple hash table for fast lookup.
 // Tyler Close proposed this.
 //
-class CloseTable {
+// BasicCloseTable takes the same template parameters as BasicOpenTable and is
+// instantiated for the same combinations.
+//
+template <class K, class V, class HashPolicy = MixHash, class Traits = KeyTraits<K>,
+          class Alloc = HeapAllocator>
+class BasicCloseTable {
+public:
+    typedef K Key;
+    typedef typename Traits::KeyArg KeyArg;
+    typedef typename KeyValue<K, V>::Value Value;
+    typedef typename KeyValue<K, V>::ValueArg ValueArg;
+
 private:
+    friend class MappedCloseTable;
+
     // The number of buckets in the table initially.
     // This must be a power of two.
     static size_t initial_buckets() { return 4; }
@@ -116,7 +642,7 @@ private:
     //
     // This fill factor was chosen to make the size of the entries
     // array, in bytes, close to a power of two. (sizeof(Entry)
-    // is 24 on both 32-bit and 64-bit systems.)
+    // is 24 on both 32-bit and 64-bit systems, for integer keys.)
     //
     static double fill_factor() { return 8.0 / 3.0; }
 
@@ -124,6 +650,178 @@ private:
     // If that ratio drops below this value, we shrink the table.
     static double min_vector_fill() { return 0.25; }
 
+    struct Entry : KeyValue<K, V> {
+        Entry *chain;
+    };
+
+    typedef Entry *EntryPtr;
+
+public:
+    class Iterator;
+
+private:
+    EntryPtr *table;            // power-of-2-sized hash table
+    size_t table_mask;          // size of table, in elements, minus one
+    Entry *entries;             // data vector, an array of Entry objects
+    size_t entries_capacity;    // size of entries, in elements
+    size_t entries_length;      // number of initialized entries
+    size_t live_count;          // entries_length less empty (removed) entries
+    uint64_t *live_bits;        // bit i is set if entries[i] is live
+    mutable Iterator *iterators;    // every Iterator over this table
+    size_t peak_bytes;          // most ever allocated at once (BytesPeak)
+
+    // get_many and has_many look keys up in groups of this many.
+    enum { BatchSize = 16 };
+
+    static hashcode_t hash_key(KeyArg key) { return HashPolicy::hash(Traits::bits(key)); }
+    inline Entry * lookup(KeyArg key, hashcode_t h);
+    inline const Entry * lookup(KeyArg key) const;
+    inline void lookup_batch(const Key *keys, size_t n, const Entry **found) const;
+#ifdef TABLE_STATS
+    mutable TableCounters counters;
+    inline const Entry * counted_lookup(KeyArg key, hashcode_t h) const;
+#endif
+    void rehash(size_t new_table_mask);
+    void rehash_in_place(size_t new_table_mask, size_t new_capacity);
+    static size_t buckets_for(size_t n);
+    void copy_from(const BasicCloseTable &other);
+    void note_peak(size_t extra);
+#ifdef HAVE_PTHREADS
+    struct RehashJob;
+    struct RelinkJob;
+#endif
+
+    static size_t bit_words(size_t n) { return (n + 63) / 64; }
+    static uint64_t *new_live_bits(size_t capacity, size_t live);
+    static void fill_live_bits(uint64_t *bits, size_t capacity, size_t live);
+    size_t next_live(size_t i) const;
+    size_t live_before(size_t i) const;
+    void restart_iterators();
+
+public:
+    // An iterator over the live entries, in insertion order, like a JS Map
+    // iterator. It stays valid whatever happens to the table: removing the
+    // entry it is on moves it to the next one; a rehash, which squeezes out
+    // removed entries, moves it to where its entry went; assign() and
+    // operator= move it back to the start; and when the table is destroyed,
+    // the iterator is done. Entries added before the iterator gets to the
+    // end are visited too.
+    //
+    // To make this work, every Iterator is on a list kept by its table.
+    // Creating, copying and destroying one costs a few pointer writes.
+    //
+    //     for (CloseTable::Iterator i = t.begin(); !i.done(); ++i)
+    //         use(i.key(), i.value());
+    //
+    class Iterator {
+    private:
+        friend class BasicCloseTable;
+
+        const BasicCloseTable *owner;   // NULL for end() and once owner is gone
+        size_t index;                   // a live entry or owner->entries_length
+        Iterator *prev, *next;          // in owner->iterators
+
+        void attach(const BasicCloseTable *t, size_t i);
+        void detach();
+
+    public:
+        // An iterator that is already done, like end().
+        Iterator();
+        Iterator(const Iterator &other);
+        Iterator &operator=(const Iterator &other);
+        ~Iterator();
+
+        bool done() const;
+        const Key &key() const;
+        Value value() const;
+        Iterator &operator++();
+
+        // Two iterators are equal if both are done, or if they are at the
+        // same entry of the same table. So comparing with end() works even
+        // if the table has grown since end() was called.
+        bool operator==(const Iterator &other) const;
+        bool operator!=(const Iterator &other) const { return !(*this == other); }
+    };
+
+    BasicCloseTable();
+    ~BasicCloseTable();
+
+    // Copy a table. The entries vector is copied as it is, removed entries
+    // and all, and the chain pointers are rebased into the copy in the same
+    // pass. Nothing is hashed.
+    BasicCloseTable(const BasicCloseTable &other);
+    BasicCloseTable &operator=(const BasicCloseTable &other);
+
+    size_t byte_size(ByteSizeOption option) const;
+    size_t size() const;
+    bool has(KeyArg key) const;
+    Value get(KeyArg key) const;
+    void set(KeyArg key, ValueArg value);
+    bool remove(KeyArg key);
+
+    // Batched lookups, as in BasicOpenTable. Here there are three stages:
+    // prefetch the buckets, then the first entry of each chain, then walk.
+    void get_many(const Key *keys, Value *values, size_t n) const;
+    void has_many(const Key *keys, bool *results, size_t n) const;
+
+    // As in BasicOpenTable. shrink_to_fit also drops removed entries from the
+    // entries vector. assign fills a new, presized entries vector in order
+    // and links each entry into the new hash table in the same pass.
+    void reserve(size_t n);
+    void shrink_to_fit();
+    void assign(const Key *keys, const Value *values, size_t n);
+
+#ifdef TABLE_STATS
+    // As in BasicOpenTable.
+    TableStats stats() const;
+#endif
+
+    Iterator begin() const;
+    Iterator end() const { return Iterator(); }
+
+    // Call f(key, value) for each entry, in insertion order, and return f.
+    // Removed entries are skipped a 64-entry word of live_bits at a time.
+    // This uses an Iterator, so f may modify the table.
+    template <class F>
+    F for_each(F f) const {
+        for (Iterator i = begin(); !i.done(); ++i)
+            f(i.key(), i.value());
+        return f;
+    }
+};
+
+typedef BasicCloseTable<Key, Value> CloseTable;
+typedef BasicCloseTable<Key, void> CloseSet;
+typedef BasicCloseTable<Key, Value, MixHash, KeyTraits<Key>, PoolAllocator> PoolCloseTable;
+typedef BasicCloseTable<Key, Value, MixHash, KeyTraits<Key>, ArenaAllocator> ArenaCloseTable;
+#ifdef HAVE_MMAP
+typedef BasicCloseTable<Key, Value, MixHash, KeyTraits<Key>, HugePageAllocator> HugeCloseTable;
+#endif
+
+
+// === IncrementalCloseTable
+// A CloseTable that never moves the whole table at once. When the entries
+// vector fills up (or empties out), new arrays are allocated, and then the
+// old entries are moved over rehash_step() at a time by each later
+// get/has/set/remove call. Until that finishes, lookups consult the new
+// arrays first and then the old ones.
+//
+// Entries still come out in insertion order: the first live_count slots of
+// the new entries vector are reserved for the old entries, so anything set
+// during the migration goes after them.
+//
+class IncrementalCloseTable {
+private:
+    // Same as in CloseTable.
+    static size_t initial_buckets() { return 4; }
+    static double fill_factor() { return 8.0 / 3.0; }
+    static double min_vector_fill() { return 0.25; }
+
+    // The number of old entries moved per operation during a rehash. This
+    // must be at least 4, so that the new entries vector can't fill up
+    // before the old one is drained.
+    static size_t rehash_step() { return 16; }
+
     struct Entry {
         Key key;
         Value value;
@@ -136,17 +834,653 @@ private:
     size_t table_mask;          // size of table, in elements, minus one
     Entry *entries;             // data vector, an array of Entry objects
     size_t entries_capacity;    // size of entries, in elements
+    size_t entries_length;      // number of initialized or reserved entries
+    size_t live_count;          // number of live entries, old and new
+
+    // While a rehash is in progress, old_entries[migrate_index..old_length)
+    // are the entries still to be moved; they are reachable from old_table.
+    // Moved entries go to entries[0..migrated_length). The rest of
+    // entries[0..reserved_length) is held for them. When no rehash is in
+    // progress, old_table and old_entries are NULL.
+    EntryPtr *old_table;
+    size_t old_table_mask;
+    Entry *old_entries;
+    size_t old_capacity;
+    size_t old_length;
+    size_t migrate_index;
+    size_t migrated_length;
+    size_t reserved_length;
+
+    inline Entry * lookup(KeyArg key, hashcode_t h);
+    void start_rehash(size_t new_table_mask);
+    void rehash_some(size_t count);
+    void finish_rehash();
+
+public:
+    IncrementalCloseTable();
+    ~IncrementalCloseTable();
+
+    size_t byte_size(ByteSizeOption option) const;
+    size_t size() const;
+
+    // Unlike the other tables, lookups are not const: each one also advances
+    // any rehash in progress.
+    bool has(KeyArg key);
+    Value get(KeyArg key);
+    void set(KeyArg key, ValueArg value);
+    bool remove(KeyArg key);
+};
+
+
+// === CompactCloseTable
+// A CloseTable whose chains are 32-bit indexes into the entries vector rather
+// than pointers. The bucket heads are indexes too, and the chain links are
+// kept in their own array, parallel to the entries, so that Entry is just a
+// key and a value. On a 64-bit system that is 4 bytes per bucket instead of
+// 8, and 20 bytes per entry instead of 24. The table can hold at most 2^32 - 1
+// entries.
+//
+class CompactCloseTable {
+private:
+    // Same as in CloseTable. The fill factor is kept the same so that the two
+    // tables rehash at the same sizes and can be compared directly.
+    static size_t initial_buckets() { return 4; }
+    static double fill_factor() { return 8.0 / 3.0; }
+    static double min_vector_fill() { return 0.25; }
+
+    // The end of a chain.
+    static const uint32_t NoEntry = uint32_t(-1);
+
+    struct Entry {
+        Key key;
+        Value value;
+    };
+
+    uint32_t *table;            // power-of-2-sized hash table of chain heads
+    size_t table_mask;          // size of table, in elements, minus one
+    Entry *entries;             // data vector, an array of Entry objects
+    uint32_t *chains;           // for each entry, the index of the next one
+    size_t entries_capacity;    // size of entries and chains, in elements
     size_t entries_length;      // number of initialized entries
     size_t live_count;          // entries_length less empty (removed) entries
 
-    inline Entry * lookup(KeyArg key, hashcode_t h);
-    inline const Entry * lookup(KeyArg key) const;
+    inline uint32_t lookup(KeyArg key, hashcode_t h) const;
     void rehash(size_t new_table_mask);
 
 public:
-    CloseTable();
-    ~CloseTable();
+    CompactCloseTable();
+    ~CompactCloseTable();
+
+    size_t byte_size(ByteSizeOption option) const;
+    size_t size() const;
+    bool has(KeyArg key) const;
+    Value get(KeyArg key) const;
+    void set(KeyArg key, ValueArg value);
+    bool remove(KeyArg key);
+};
+
+
+// === SwissCloseTable
+// A CloseTable whose hash index is a Swiss-table-style array of 1-byte tags,
+// probed 16 at a time, rather than an array of chain heads. The entries are
+// still kept in a vector in insertion order. A lookup scans a group of tags
+// (with SSE2 where available) and only touches the entries whose tag
+// matches, so a miss usually costs one cache line rather than a chain walk.
+//
+// The low 7 bits of the hash code are the tag and the rest choose the group,
+// so this table always uses FibonacciHash; with the identity, consecutive
+// keys would all land in the same group.
+//
+class SwissCloseTable {
+private:
+    // The number of index slots initially. This must be a power of two and
+    // a multiple of group_size().
+    static size_t initial_slots() { return 16; }
+
+    // Tags are compared one group at a time.
+    static size_t group_size() { return 16; }
+
+    // The maximum fraction of index slots that are full or deleted.
+    // It is an invariant that
+    //     entries_capacity == floor((slot_mask + 1) * max_fill_ratio()).
+    // Each entry ever appended uses up one slot until the next rehash, so
+    // this guarantees every probe sequence reaches an empty slot.
+    static double max_fill_ratio() { return 7.0 / 8.0; }
+
+    // Same as CloseTable::min_vector_fill().
+    static double min_vector_fill() { return 0.25; }
+
+    // Each slot's tag is either empty, deleted, or (when full) the low 7 bits
+    // of the key's hash code. Only the non-full tags have the high bit set.
+    enum { TagEmpty = 0x80, TagDeleted = 0xfe };
+
+    struct Entry {
+        Key key;
+        Value value;
+    };
+
+    uint8_t *tags;              // power-of-2-sized array of 1-byte tags
+    uint32_t *slots;            // for each full tag, an index into entries
+    size_t slot_mask;           // size of tags, in elements, minus one
+    Entry *entries;             // data vector, an array of Entry objects
+    size_t entries_capacity;    // size of entries, in elements
+    size_t entries_length;      // number of initialized entries
+    size_t live_count;          // entries_length less empty (removed) entries
+
+    inline size_t lookup(KeyArg key, hashcode_t h) const;
+    inline size_t find_free_slot(hashcode_t h) const;
+    void rehash(size_t new_slot_mask);
+
+public:
+    SwissCloseTable();
+    ~SwissCloseTable();
+
+    size_t byte_size(ByteSizeOption option) const;
+    size_t size() const;
+    bool has(KeyArg key) const;
+    Value get(KeyArg key) const;
+    void set(KeyArg key, ValueArg value);
+    bool remove(KeyArg key);
+};
+
+
+// === BucketCloseTable
+// A CloseTable whose hash index is an array of 64-byte buckets, one cache
+// line each, instead of chains running through the entries. A bucket holds
+// up to BucketSlots (hash fragment, entry index) pairs and the index of an
+// overflow bucket. A lookup compares the 16-bit fragments in the key's bucket
+// and only reads the entries whose fragment matches, so it usually costs one
+// miss in the index and one in the entries instead of a miss per link. The
+// entries themselves stay in a vector in insertion order, as in CloseTable.
+//
+// The low bits of the hash code choose the bucket and the high 16 bits are
+// the fragment. The table can hold at most 2^32 - 1 entries, so it never has
+// anywhere near 2^48 buckets, and the two never overlap.
+//
+class BucketCloseTable {
+private:
+    // The number of buckets in the table initially. This must be a power of
+    // two.
+    static size_t initial_buckets() { return 2; }
+
+    // The maximum mean number of entries per bucket. It is an invariant that
+    //     entries_capacity == floor((table_mask + 1) * fill_factor()).
+    // At 5 per bucket, about 1% of buckets overflow just before a rehash.
+    static double fill_factor() { return 5.0; }
+
+    // Same as CloseTable::min_vector_fill().
+    static double min_vector_fill() { return 0.25; }
+
+    // BucketSlots is fixed at 10 by match_fragment() in tables.cpp.
+    enum { BucketSlots = 10, BucketAlign = 64 };
+
+    // An empty slot, or the end of a list of buckets.
+    static const uint32_t NoEntry = uint32_t(-1);
+
+    struct Bucket {
+        uint16_t fragments[BucketSlots];    // 0 if the slot is free
+        uint32_t overflow;                  // next bucket, or NoEntry
+        uint32_t indexes[BucketSlots];      // for each used slot, an index into entries
+    };
+
+    struct Entry {
+        Key key;
+        Value value;
+    };
+
+    char *bucket_memory;        // where buckets was allocated
+    Bucket *buckets;            // the table_mask + 1 main buckets, then overflow buckets
+    size_t table_mask;          // number of main buckets, minus one
+    size_t buckets_length;      // number of buckets in use, main and overflow
+    size_t buckets_capacity;    // size of buckets, in elements
+    Entry *entries;             // data vector, an array of Entry objects
+    size_t entries_capacity;    // size of entries, in elements
+    size_t entries_length;      // number of initialized entries
+    size_t live_count;          // entries_length less empty (removed) entries
+
+    static uint16_t fragment(hashcode_t h);
+    inline size_t lookup(KeyArg key, hashcode_t h) const;
+    void insert(hashcode_t h, uint32_t index);
+    void allocate_buckets(size_t main, size_t capacity);
+    void rehash(size_t new_table_mask);
+
+    BucketCloseTable(const BucketCloseTable &);
+    BucketCloseTable &operator=(const BucketCloseTable &);
+
+public:
+    BucketCloseTable();
+    ~BucketCloseTable();
+
+    size_t byte_size(ByteSizeOption option) const;
+    size_t size() const;
+    bool has(KeyArg key) const;
+    Value get(KeyArg key) const;
+    void set(KeyArg key, ValueArg value);
+    bool remove(KeyArg key);
+};
+
+
+// === InlineTable
+// A Table that keeps its first N entries in arrays inside the InlineTable
+// object itself and finds them by a linear scan, in insertion order. Only
+// when the (N+1)th key is added does it allocate a Table on the heap and move
+// everything into it, oldest first, so that a CloseTable's order is kept.
+// After that, every call is forwarded to the heap table.
+//
+// Tables that never grow past N entries never touch the heap.
+//
+// InlineTable is instantiated in tables.cpp for OpenTable and CloseTable.
+//
+template <class Table, size_t N = 8>
+class InlineTable {
+private:
+    Key keys[N];                // keys[0..inline_count) are the inline keys
+    Value values[N];            // and these are their values
+    size_t inline_count;
+    Table *table;               // NULL until there are more than N entries
+
+    inline size_t find(KeyArg key) const;
+
+    InlineTable(const InlineTable &);
+    InlineTable &operator=(const InlineTable &);
+
+public:
+    InlineTable();
+    ~InlineTable();
+
+    size_t byte_size(ByteSizeOption option) const;
+    size_t size() const;
+    bool has(KeyArg key) const;
+    Value get(KeyArg key) const;
+    void set(KeyArg key, ValueArg value);
+    bool remove(KeyArg key);
+};
+
+typedef InlineTable<OpenTable> InlineOpenTable;
+typedef InlineTable<CloseTable> InlineCloseTable;
+
+
+// === CowTable
+// A Table whose copies are copy-on-write snapshots. Copying a CowTable takes
+// constant time and almost no memory: the copy shares the original's Table,
+// which keeps a count of its sharers. The first set or remove on any one of
+// them, while the Table is still shared, gives that one a private copy of the
+// Table (made by Table's copy constructor) before changing it. A snapshot
+// that is never written to costs only the size of a CowTable.
+//
+// The count is not atomic, so a table and all its snapshots must be used on
+// one thread.
+//
+// CowTable is instantiated in tables.cpp for OpenTable and CloseTable.
+//
+template <class Table>
+class CowTable {
+private:
+    struct Shared {
+        Table table;
+        size_t refs;            // number of CowTables sharing this
+
+        Shared() : refs(1) {}
+        explicit Shared(const Table &t) : table(t), refs(1) {}
+    };
+
+    Shared *shared;
+
+    void release();
+    Table &unshare();
+
+public:
+    CowTable();
+    CowTable(const CowTable &other);
+    CowTable &operator=(const CowTable &other);
+    ~CowTable();
+
+    // True if this table's storage is shared with a snapshot.
+    bool is_shared() const;
+
+    size_t byte_size(ByteSizeOption option) const;
+    size_t size() const;
+    bool has(KeyArg key) const;
+    Value get(KeyArg key) const;
+    void set(KeyArg key, ValueArg value);
+    bool remove(KeyArg key);
+};
+
+typedef CowTable<OpenTable> CowOpenTable;
+typedef CowTable<CloseTable> CowCloseTable;
+
+
+// === Traces
+// A trace is a log of table operations, which hashbench --replay plays back
+// against each table implementation. A trace file is a TraceHeader followed
+// by header.count TraceRecords, in the byte order of the machine that wrote
+// it. Records are all the same size, so a reader can mmap the file and use
+// the records where they lie.
+//
+// A trace can involve several tables, numbered 0 to header.table_count - 1.
+// Each record also stores what the operation returned (the value got, or 1 or
+// 0 for has and remove) so that a replay can be checked.
+
+enum TraceOp { TraceGet, TraceHas, TraceSet, TraceRemove };
+
+struct TraceHeader {
+    char magic[8];          // "dhttrace"
+    uint32_t version;       // TraceHeader::Version
+    uint32_t record_size;   // sizeof(TraceRecord)
+    uint64_t count;         // number of records
+    uint32_t table_count;
+    uint32_t reserved;
+
+    enum { Version = 1 };
+
+    bool valid() const;
+};
+
+struct TraceRecord {
+    uint8_t op;             // a TraceOp
+    uint8_t reserved[3];
+    uint32_t table;
+    Key key;
+    Value value;            // the value set, or the result
+};
+
+// Writes a trace file. Records go through stdio's buffer; close() fills in
+// the header.
+class TraceWriter {
+private:
+    FILE *file;
+    uint64_t count;
+    uint32_t table_count;
+
+    bool write_header();
+
+    TraceWriter(const TraceWriter &);
+    TraceWriter &operator=(const TraceWriter &);
+
+public:
+    TraceWriter();
+    ~TraceWriter();
+
+    // Create or truncate the file. Return false on error.
+    bool open(const char *filename);
+
+    // Finish the file. Return false if anything went wrong writing it, or if
+    // no file is open.
+    bool close();
+
+    uint32_t new_table() { return table_count++; }
+    void write(TraceOp op, uint32_t table, KeyArg key, ValueArg value);
+};
+
+// A Table that also writes each operation on it to a TraceWriter, as one of
+// the writer's tables. Use it in place of the Table in any code that uses
+// the OpenTable/CloseTable interface to capture that code's access pattern.
+//
+// TraceRecorder is instantiated in tables.cpp for OpenTable and CloseTable.
+//
+template <class Table>
+class TraceRecorder {
+private:
+    Table table;
+    TraceWriter *writer;
+    uint32_t id;
+
+    TraceRecorder(const TraceRecorder &);
+    TraceRecorder &operator=(const TraceRecorder &);
+
+public:
+    explicit TraceRecorder(TraceWriter &writer);
+
+    size_t byte_size(ByteSizeOption option) const;
+    size_t size() const;
+    bool has(KeyArg key) const;
+    Value get(KeyArg key) const;
+    void set(KeyArg key, ValueArg value);
+    bool remove(KeyArg key);
+};
+
+
+#ifdef HAVE_MMAP
+// === MappedCloseTable and MappedOpenTable
+// A CloseTable or OpenTable saved to a file that can be mapped back into
+// memory and used at once. open() maps the file, and get and has work on the
+// mapping directly, without reading or rebuilding anything. The file holds
+// array indices rather than pointers, so it works at any address:
+//
+//   - a MappedCloseTable file is a header, the bucket array (the index of
+//     the first entry in each chain), and the live entries in insertion
+//     order as three arrays: keys, values, and the index of the next entry
+//     in each chain.
+//   - a MappedOpenTable file is a header and an image of the table's slots.
+//
+// The mapping is read-only and private. The first set or remove copies the
+// contents into an ordinary table and unmaps the file; after that, the mapped
+// table just forwards to that table.
+//
+// A file can only be opened in a process with the same MixHash::seed and byte
+// order as the one that saved it. open() returns false otherwise.
+//
+// open() checks the header and the file's size, but reading every index in
+// a big file would take as long as rebuilding the table, so lookups check
+// the indices as they go instead. A corrupt file gives wrong answers, but
+// never reads outside the mapping or loops forever.
+
+class MappedCloseTable {
+private:
+    void *map;                  // the mapped file, or NULL
+    size_t map_size;
+    size_t count;               // number of entries
+    size_t mask;                // number of buckets, minus one
+    const uint32_t *buckets;
+    const Key *keys;
+    const Value *values;
+    const uint32_t *chains;
+    CloseTable *table;          // after the first change, the contents
+
+    enum { NoEntry = 0xffffffff };
+
+    inline uint32_t lookup(KeyArg key) const;
+    void unshare();
+    void unmap();
+
+    MappedCloseTable(const MappedCloseTable &);
+    MappedCloseTable &operator=(const MappedCloseTable &);
+
+public:
+    MappedCloseTable();
+    ~MappedCloseTable();
+
+    // Write the contents of table to a file. Return false on error.
+    static bool save(const CloseTable &table, const char *filename);
+
+    // Replace this table's contents with the file's. Return false if the
+    // file can't be mapped or wasn't written by save() on a compatible
+    // system; in that case the table is left empty.
+    bool open(const char *filename);
+
+    size_t byte_size(ByteSizeOption option) const;
+    size_t size() const;
+    bool has(KeyArg key) const;
+    Value get(KeyArg key) const;
+    void set(KeyArg key, ValueArg value);
+    bool remove(KeyArg key);
+};
+
+class MappedOpenTable {
+private:
+    struct Slot {
+        Key key;
+        Value value;
+    };
+
+    void *map;
+    size_t map_size;
+    size_t count;               // number of live slots
+    size_t mask;                // number of slots, minus one
+    const Slot *slots;
+    OpenTable *table;
+
+    inline const Slot *lookup(KeyArg key) const;
+    void unshare();
+    void unmap();
+
+    MappedOpenTable(const MappedOpenTable &);
+    MappedOpenTable &operator=(const MappedOpenTable &);
+
+public:
+    MappedOpenTable();
+    ~MappedOpenTable();
+
+    static bool save(const OpenTable &table, const char *filename);
+    bool open(const char *filename);
+
+    size_t byte_size(ByteSizeOption option) const;
+    size_t size() const;
+    bool has(KeyArg key) const;
+    Value get(KeyArg key) const;
+    void set(KeyArg key, ValueArg value);
+    bool remove(KeyArg key);
+};
+#endif  // HAVE_MMAP
+
+
+#ifdef HAVE_PTHREADS
+// === ConcurrentCloseTable
+// A CloseTable that one thread (the writer) may modify while any number of
+// other threads read it without taking a lock.
+//
+// This works because a CloseTable never moves or unlinks an entry except in
+// rehash. set() fills in a new entry completely before linking it in at the
+// head of its chain, and remove() only empties the key. rehash() builds a
+// whole new set of arrays and publishes them with a single pointer store.
+// The old arrays are freed once no reader can still be using them; each
+// reader records the epoch in which its current lookup started, and the
+// writer frees arrays only after every such lookup has finished.
+//
+// The writer may call has() and get() directly. Other threads must each make
+// a Reader and look keys up through it. All Readers must be destroyed before
+// the table.
+//
+// This uses GCC's __atomic builtins, so it is only built with HAVE_PTHREADS.
+//
+class ConcurrentCloseTable {
+private:
+    // Same as in CloseTable.
+    static size_t initial_buckets() { return 4; }
+    static double fill_factor() { return 8.0 / 3.0; }
+    static double min_vector_fill() { return 0.25; }
+
+    // The most Readers that can exist at once.
+    enum { MaxReaders = 64 };
+
+    struct Entry {
+        Key key;
+        Value value;
+        Entry *chain;
+    };
+
+    typedef Entry *EntryPtr;
+
+    // Everything a reader needs, replaced as a unit by rehash.
+    struct Storage {
+        EntryPtr *table;            // power-of-2-sized hash table
+        size_t table_mask;          // size of table, in elements, minus one
+        Entry *entries;             // data vector, an array of Entry objects
+        size_t entries_capacity;    // size of entries, in elements
+    };
+
+    // One per Reader. epoch is the value of the table's epoch when the
+    // reader's current lookup started, or 0 between lookups. Each slot has a
+    // cache line to itself so that readers don't slow each other down.
+    struct ReaderSlot {
+        size_t epoch;
+        size_t in_use;
+        char padding[64 - 2 * sizeof(size_t)];
+    };
+
+    // Arrays replaced by rehash that some reader may still be using.
+    struct Retired {
+        Storage *storage;
+        size_t epoch;               // the table's epoch when it was replaced
+    };
+
+    Storage *storage;               // the current arrays
+    size_t entries_length;          // number of initialized entries
+    size_t live_count;              // entries_length less empty (removed) entries
+    size_t epoch;                   // incremented each time storage is replaced
+    std::vector<Retired> retired;
+    ReaderSlot readers[MaxReaders];
+
+    static Storage *new_storage(size_t table_mask);
+    static void delete_storage(Storage *s);
+    static inline Entry * lookup(const Storage *s, KeyArg key, hashcode_t h);
+    void rehash(size_t new_table_mask);
+    void reclaim();
+
+public:
+    ConcurrentCloseTable();
+    ~ConcurrentCloseTable();
+
+    size_t byte_size(ByteSizeOption option) const;
+    size_t size() const;
+    bool has(KeyArg key) const;
+    Value get(KeyArg key) const;
+    void set(KeyArg key, ValueArg value);
+    bool remove(KeyArg key);
+
+    // A thread's handle for reading the table while the writer modifies it.
+    class Reader {
+        ConcurrentCloseTable &table;
+        ReaderSlot *slot;
+
+        Reader(const Reader &);
+        Reader &operator=(const Reader &);
+
+    public:
+        explicit Reader(ConcurrentCloseTable &table);
+        ~Reader();
+
+        bool has(KeyArg key);
+        Value get(KeyArg key);
+    };
+};
+
+
+// === ShardedTable
+// 2^ShardBits independent Tables, each behind its own mutex, so that
+// threads working on different shards don't wait for each other. The top
+// ShardBits bits of the key's MixHash choose the shard; the tables use the low
+// bits to choose a bucket, so every shard still sees well-spread keys. Each
+// shard is padded so that two shards' locks never share a cache line.
+//
+// With ShardBits == 0 this is a single table behind a single lock.
+//
+// ShardedTable is instantiated in tables.cpp for OpenTable and CloseTable.
+//
+template <class Table, int ShardBits = 6>
+class ShardedTable {
+private:
+    enum { NumShards = 1 << ShardBits };
+
+    struct Shard {
+        mutable pthread_mutex_t lock;
+        Table table;
+        char padding[64];
+    };
+
+    Shard *shards;
+
+    static inline Shard & shard_for(Shard *shards, KeyArg key);
+
+    ShardedTable(const ShardedTable &);
+    ShardedTable &operator=(const ShardedTable &);
+
+public:
+    ShardedTable();
+    ~ShardedTable();
 
+    // byte_size() and size() lock each shard in turn, so while other threads
+    // are modifying the table the total is only approximate.
     size_t byte_size(ByteSizeOption option) const;
     size_t size() const;
     bool has(KeyArg key) const;
@@ -154,6 +1488,7 @@ public:
     void set(KeyArg key, ValueArg value);
     bool remove(KeyArg key);
 };
+#endif  // HAVE_PTHREADS
 
 
 #endif  // tables_h_